@@ -0,0 +1,58 @@
+#include "allocationcounter.h"
+
+#include <QAtomicInteger>
+
+namespace {
+// Constant initialized, so it works for the allocations before main()
+QAtomicInteger<qint64> s_allocations(0);
+}
+
+#ifdef __GLIBC__
+#include <cstddef>
+
+// What glibc's own malloc() and friends call
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *pointer, size_t size);
+void __libc_free(void *pointer);
+
+void *malloc(size_t size)
+{
+    s_allocations.fetchAndAddRelaxed(1);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    s_allocations.fetchAndAddRelaxed(1);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size)
+{
+    s_allocations.fetchAndAddRelaxed(1);
+    return __libc_realloc(pointer, size);
+}
+
+// Has to be replaced along with the others
+void free(void *pointer)
+{
+    __libc_free(pointer);
+}
+}
+#endif
+
+bool AllocationCounter::isAvailable()
+{
+#ifdef __GLIBC__
+    return true;
+#else
+    return false;
+#endif
+}
+
+qint64 AllocationCounter::count()
+{
+    return s_allocations.loadAcquire();
+}
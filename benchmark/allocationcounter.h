@@ -0,0 +1,19 @@
+#ifndef ALLOCATIONCOUNTER_H
+#define ALLOCATIONCOUNTER_H
+
+#include <QtGlobal>
+
+// Counts the calls to malloc(), calloc() and realloc() in the whole
+// process, by wrapping the glibc allocator. Also catches what Qt allocates
+// itself, which overriding operator new wouldn't. Other threads are
+// counted too, so only measure while they are idle.
+class AllocationCounter
+{
+public:
+    // Only with glibc, count() is always 0 otherwise
+    static bool isAvailable();
+
+    static qint64 count();
+};
+
+#endif // ALLOCATIONCOUNTER_H
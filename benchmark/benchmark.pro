@@ -0,0 +1,40 @@
+#-------------------------------------------------
+#
+# Benchmarks for the EPUB loading code, run with --help for options
+#
+#-------------------------------------------------
+
+QT       += core gui xml svg concurrent
+
+## The document code uses the private CSS parser
+QT += gui-private
+DEFINES += DEBUG_CSS
+
+CONFIG   += c++11 console
+CONFIG   -= app_bundle
+
+QT       += KArchive
+
+TARGET = epubbenchmark
+TEMPLATE = app
+
+INCLUDEPATH += ..
+
+SOURCES += main.cpp \
+    allocationcounter.cpp \
+    epubbenchmark.cpp \
+    epubgenerator.cpp \
+    ../epubcontainer.cpp \
+    ../epubdocument.cpp \
+    ../memorybudget.cpp \
+    ../chapterpreprocessor.cpp \
+    ../epubsession.cpp
+
+HEADERS  += allocationcounter.h \
+    epubbenchmark.h \
+    epubgenerator.h \
+    ../epubcontainer.h \
+    ../epubdocument.h \
+    ../memorybudget.h \
+    ../chapterpreprocessor.h \
+    ../epubsession.h
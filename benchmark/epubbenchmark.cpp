@@ -0,0 +1,540 @@
+#include "epubbenchmark.h"
+#include "allocationcounter.h"
+
+#include "epubcontainer.h"
+#include "epubdocument.h"
+#include "epubsession.h"
+#include "chapterpreprocessor.h"
+
+#include <QAbstractTextDocumentLayout>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QImage>
+#include <QPainter>
+#include <QScopedPointer>
+#include <QSvgRenderer>
+#include <QtConcurrent>
+#include <QTextDocument>
+#include <QThreadPool>
+#include <qmath.h>
+#include <algorithm>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+namespace {
+// The rest of the chapters are inserted from the event loop
+void waitForLoad(EPubDocument *document)
+{
+    if (!document->isLoading()) {
+        return;
+    }
+    QEventLoop loop;
+    QObject::connect(document, &EPubDocument::loadCompleted, &loop, &QEventLoop::quit);
+    loop.exec();
+}
+
+// The allocations are counted for the whole process, so nothing can be
+// left running in the background, like images decoded for the last paint
+void waitForIdleThreads()
+{
+    QThreadPool::globalInstance()->waitForDone();
+    EPubDocument::svgRenderPool()->waitForDone();
+}
+
+// Bytes currently allocated on the heap, or -1 if we don't know how to get it
+qint64 heapUsage()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    return mallinfo2().uordblks;
+#elif defined(__GLIBC__)
+    return mallinfo().uordblks;
+#else
+    return -1;
+#endif
+}
+}
+
+EPubBenchmark::EPubBenchmark(const QString &path, int iterations) :
+    m_path(path),
+    m_iterations(qMax(1, iterations)),
+    m_pageSize(600, 800),
+    m_failed(false)
+{
+}
+
+bool EPubBenchmark::run()
+{
+    m_failed = false;
+
+    benchmarkOpenFile();
+    benchmarkParseContentFile();
+    benchmarkGetFile();
+    benchmarkGetImage();
+    benchmarkRenderSvgs();
+    benchmarkPreprocessChapters();
+    benchmarkLoadDocument();
+
+    return !m_failed;
+}
+
+QJsonObject EPubBenchmark::results() const
+{
+    QJsonObject object;
+    object["file"] = m_path;
+    object["iterations"] = m_iterations;
+    object["success"] = !m_failed;
+    object["measurements"] = m_results;
+    return object;
+}
+
+void EPubBenchmark::benchmarkOpenFile()
+{
+    Measurement measurement;
+    measurement.name = "openFile";
+    measurement.operations = 1;
+
+    QElapsedTimer timer;
+    for (int i=0; i<m_iterations; i++) {
+        EPubContainer container(nullptr);
+        timer.start();
+        if (!container.openFile(m_path)) {
+            qWarning() << "Failed to open" << m_path;
+            m_failed = true;
+            return;
+        }
+        measurement.samples.append(timer.nsecsElapsed());
+    }
+
+    addMeasurement(measurement);
+}
+
+void EPubBenchmark::benchmarkParseContentFile()
+{
+    Measurement measurement;
+    measurement.name = "parseContentFile";
+    measurement.operations = 1;
+
+    qint64 heapBytes = -1;
+
+    QElapsedTimer timer;
+    for (int i=0; i<m_iterations; i++) {
+        // Open the archive first, so only parsing container.xml and the content file is measured
+        EPubContainer container(nullptr);
+        if (!container.openArchive(m_path)) {
+            m_failed = true;
+            return;
+        }
+
+        const qint64 heapBefore = heapUsage();
+        timer.start();
+        if (!container.parseContents()) {
+            m_failed = true;
+            return;
+        }
+        measurement.samples.append(timer.nsecsElapsed());
+
+        // What the parsed manifest, spine and metadata take, the DOM is freed by now
+        if (heapBefore != -1) {
+            heapBytes = heapUsage() - heapBefore;
+        }
+    }
+
+    addMeasurement(measurement);
+
+    if (heapBytes != -1) {
+        QJsonObject object;
+        object["name"] = "contentFileHeap";
+        object["bytes"] = heapBytes;
+        m_results.append(object);
+    }
+}
+
+void EPubBenchmark::benchmarkGetFile()
+{
+    EPubContainer container(nullptr);
+    if (!container.openFile(m_path)) {
+        m_failed = true;
+        return;
+    }
+
+    QStringList paths;
+    for (const QString &id : container.getManifestItems()) {
+        const QString path = container.getEpubItem(id).path;
+        if (!path.isEmpty()) {
+            paths.append(path);
+        }
+    }
+    if (paths.isEmpty()) {
+        qInfo() << "No files in the manifest of" << m_path << "skipping getFileSize";
+        return;
+    }
+
+    Measurement measurement;
+    measurement.name = "getFileSize";
+    measurement.operations = paths.count();
+
+    Measurement readMeasurement;
+    readMeasurement.name = "getIoDevice+readAll";
+    readMeasurement.operations = paths.count();
+
+    QElapsedTimer timer;
+    for (int i=0; i<m_iterations; i++) {
+        timer.start();
+        for (const QString &path : paths) {
+            if (container.getFileSize(path) == -1) {
+                qWarning() << "Missing file" << path;
+                m_failed = true;
+            }
+        }
+        measurement.samples.append(timer.nsecsElapsed());
+
+        qint64 bytes = 0;
+        timer.start();
+        for (const QString &path : paths) {
+            QSharedPointer<QIODevice> ioDevice = container.getIoDevice(path);
+            if (ioDevice) {
+                bytes += ioDevice->readAll().size();
+            }
+        }
+        readMeasurement.samples.append(timer.nsecsElapsed());
+        readMeasurement.bytes = bytes;
+    }
+
+    addMeasurement(measurement);
+    addMeasurement(readMeasurement);
+}
+
+void EPubBenchmark::benchmarkGetImage()
+{
+    EPubContainer container(nullptr);
+    if (!container.openFile(m_path)) {
+        m_failed = true;
+        return;
+    }
+
+    // QImage can't read the SVGs without the plugin, and they are rendered differently anyway
+    QStringList imageIds;
+    for (const QString &id : container.getManifestItems()) {
+        const QByteArray mimetype = container.getEpubItem(id).mimetype;
+        if (mimetype.startsWith("image/") && !mimetype.startsWith("image/svg")) {
+            imageIds.append(id);
+        }
+    }
+    if (imageIds.isEmpty()) {
+        qInfo() << "No images in" << m_path << "skipping getImage";
+        return;
+    }
+
+    Measurement measurement;
+    measurement.name = "getImage";
+    measurement.operations = imageIds.count();
+
+    QElapsedTimer timer;
+    for (int i=0; i<m_iterations; i++) {
+        qint64 bytes = 0;
+        timer.start();
+        for (const QString &id : imageIds) {
+            const QImage image = container.getImage(id);
+            if (image.isNull()) {
+                qWarning() << "Failed to load image" << id;
+                m_failed = true;
+            }
+            bytes += image.sizeInBytes();
+        }
+        measurement.samples.append(timer.nsecsElapsed());
+        measurement.bytes = bytes;
+    }
+
+    addMeasurement(measurement);
+}
+
+void EPubBenchmark::benchmarkLoadDocument()
+{
+    Measurement loadMeasurement;
+    loadMeasurement.name = "loadDocument";
+    loadMeasurement.operations = 1;
+
+    // Until there is something to show
+    Measurement firstChunkMeasurement;
+    firstChunkMeasurement.name = "loadFirstChunk";
+    firstChunkMeasurement.operations = 1;
+
+    Measurement paintMeasurement;
+    paintMeasurement.name = "paint";
+
+    // A second view of a book that is already open
+    Measurement sharedLoadMeasurement;
+    sharedLoadMeasurement.name = "loadSharedDocument";
+    sharedLoadMeasurement.operations = 1;
+
+    QImage target(m_pageSize, QImage::Format_ARGB32_Premultiplied);
+
+    QElapsedTimer timer;
+    for (int i=0; i<m_iterations; i++) {
+        // Otherwise everything after the first iteration reuses the session
+        EPubSession::releaseUnused();
+
+        // Images are decoded while painting, like before they were decoded
+        // in the background, so the paint numbers stay comparable and
+        // nothing is left running into the next measurements
+        EPubDocument document(nullptr);
+        document.setPageSize(m_pageSize);
+        document.setSynchronousResources(true);
+
+        waitForIdleThreads();
+        const qint64 allocationsBefore = AllocationCounter::count();
+        timer.start();
+        document.openDocument(m_path);
+        if (!document.loaded()) {
+            qWarning() << "Failed to load document" << m_path;
+            m_failed = true;
+            return;
+        }
+        firstChunkMeasurement.samples.append(timer.nsecsElapsed());
+        waitForLoad(&document);
+        loadMeasurement.samples.append(timer.nsecsElapsed());
+        if (AllocationCounter::isAvailable()) {
+            loadMeasurement.allocations = AllocationCounter::count() - allocationsBefore;
+        }
+
+        // Same as what Widget does, one page at a time
+        const int pageHeight = m_pageSize.height();
+        const int pageCount = qMax(1, qCeil(document.size().height() / pageHeight));
+
+        QAbstractTextDocumentLayout::PaintContext paintContext;
+        paintContext.palette.setColor(QPalette::Text, Qt::black);
+
+        timer.start();
+        for (int page=0; page<pageCount; page++) {
+            target.fill(Qt::white);
+            QPainter painter(&target);
+            paintContext.clip = QRectF(0, page * pageHeight, m_pageSize.width(), pageHeight);
+            painter.translate(0, -page * pageHeight);
+            painter.setClipRect(paintContext.clip);
+            document.documentLayout()->draw(&painter, paintContext);
+        }
+        paintMeasurement.samples.append(timer.nsecsElapsed());
+        paintMeasurement.operations = pageCount;
+
+        EPubDocument sharedDocument(nullptr);
+        sharedDocument.setPageSize(m_pageSize);
+
+        timer.start();
+        sharedDocument.openDocument(m_path);
+        waitForLoad(&sharedDocument);
+        sharedLoadMeasurement.samples.append(timer.nsecsElapsed());
+    }
+
+    addMeasurement(loadMeasurement);
+    addMeasurement(firstChunkMeasurement);
+    addMeasurement(paintMeasurement);
+    addMeasurement(sharedLoadMeasurement);
+}
+
+void EPubBenchmark::benchmarkRenderSvgs()
+{
+    EPubContainer container(nullptr);
+    if (!container.openFile(m_path)) {
+        m_failed = true;
+        return;
+    }
+
+    // Extracted the same way as when loading the document
+    QVector<QByteArray> svgs;
+    ChapterPreprocessor preprocessor;
+    preprocessor.setSvgHandler([&](const QByteArray &svg) {
+        svgs.append(svg);
+        return QString();
+    });
+    preprocessor.setResourceLoader([&](const QString &path) {
+        return container.readFile(path);
+    });
+    preprocessor.setSegmentHandler([](const QString &) {});
+    for (const QString &id : container.getItems()) {
+        const QString path = container.getEpubItem(id).path;
+        EpubChunkReader reader = container.getChunkReader(path);
+        if (reader.isValid()) {
+            preprocessor.process(reader, path);
+        }
+    }
+    if (svgs.isEmpty()) {
+        return;
+    }
+
+    QVector<QSize> sizes;
+    for (const QByteArray &svg : svgs) {
+        QSize size = QSvgRenderer(svg).defaultSize();
+        if (size.isValid()) {
+            size.scale(m_pageSize, Qt::KeepAspectRatio);
+        } else {
+            size = m_pageSize;
+        }
+        sizes.append(size);
+    }
+
+    Measurement measurement;
+    measurement.name = "renderSvgs";
+    measurement.operations = svgs.count();
+
+    Measurement pooledMeasurement;
+    pooledMeasurement.name = "renderSvgsPooled";
+    pooledMeasurement.operations = svgs.count();
+
+    // What it costs to draw them afterwards, in the format we used to render to and the current one
+    Measurement drawArgbMeasurement;
+    drawArgbMeasurement.name = "drawSvgsArgb32";
+    drawArgbMeasurement.operations = svgs.count();
+
+    Measurement drawPremultipliedMeasurement;
+    drawPremultipliedMeasurement.name = "drawSvgsPremultiplied";
+    drawPremultipliedMeasurement.operations = svgs.count();
+
+    QImage target(m_pageSize, QImage::Format_ARGB32_Premultiplied);
+
+    QElapsedTimer timer;
+    for (int i=0; i<m_iterations; i++) {
+        QVector<QImage> rendered;
+        qint64 bytes = 0;
+
+        // Like it was done in loadResource() before
+        timer.start();
+        for (int j=0; j<svgs.count(); j++) {
+            rendered.append(EPubDocument::renderSvg(svgs[j], sizes[j]));
+            bytes += rendered.last().sizeInBytes();
+        }
+        measurement.samples.append(timer.nsecsElapsed());
+        measurement.bytes = bytes;
+
+        timer.start();
+        QVector<QFuture<QImage>> futures;
+        for (int j=0; j<svgs.count(); j++) {
+            futures.append(QtConcurrent::run(EPubDocument::svgRenderPool(), &EPubDocument::renderSvg, svgs[j], sizes[j]));
+        }
+        for (QFuture<QImage> &future : futures) {
+            future.waitForFinished();
+        }
+        pooledMeasurement.samples.append(timer.nsecsElapsed());
+        pooledMeasurement.bytes = bytes;
+
+        QVector<QImage> converted;
+        for (const QImage &image : rendered) {
+            converted.append(image.convertToFormat(QImage::Format_ARGB32));
+        }
+
+        QPainter painter(&target);
+        timer.start();
+        for (const QImage &image : converted) {
+            painter.drawImage(0, 0, image);
+        }
+        drawArgbMeasurement.samples.append(timer.nsecsElapsed());
+
+        timer.start();
+        for (const QImage &image : rendered) {
+            painter.drawImage(0, 0, image);
+        }
+        drawPremultipliedMeasurement.samples.append(timer.nsecsElapsed());
+    }
+
+    addMeasurement(measurement);
+    addMeasurement(pooledMeasurement);
+    addMeasurement(drawArgbMeasurement);
+    addMeasurement(drawPremultipliedMeasurement);
+}
+
+void EPubBenchmark::benchmarkPreprocessChapters()
+{
+    EPubContainer container(nullptr);
+    if (!container.openFile(m_path)) {
+        m_failed = true;
+        return;
+    }
+
+    QStringList paths;
+    for (const QString &id : container.getItems()) {
+        const QString path = container.getEpubItem(id).path;
+        if (!path.isEmpty()) {
+            paths.append(path);
+        }
+    }
+
+    // The part of loading the document that is ours, without QTextDocument
+    Measurement measurement;
+    measurement.name = "preprocessChapters";
+    measurement.operations = paths.count();
+
+    ChapterPreprocessor preprocessor;
+    preprocessor.setSvgHandler([](const QByteArray &) { return QString("svgcache:1"); });
+    preprocessor.setResourceLoader([](const QString &) { return QByteArray(); });
+
+    qint64 bytes = 0;
+    preprocessor.setSegmentHandler([&](const QString &html) {
+        bytes += html.size() * qint64(sizeof(QChar));
+    });
+
+    QElapsedTimer timer;
+    for (int i=0; i<m_iterations; i++) {
+        bytes = 0;
+        waitForIdleThreads();
+        const qint64 allocationsBefore = AllocationCounter::count();
+        timer.start();
+        for (const QString &path : paths) {
+            // Same as loading the document, includes opening the files
+            EpubChunkReader reader = container.getChunkReader(path, EPubContainer::ChapterConsumer);
+            if (!preprocessor.process(reader, path)) {
+                qWarning().noquote() << "Problem while reading chapter:" << preprocessor.errorString();
+            }
+        }
+        measurement.samples.append(timer.nsecsElapsed());
+        if (AllocationCounter::isAvailable()) {
+            measurement.allocations = AllocationCounter::count() - allocationsBefore;
+        }
+        measurement.bytes = bytes;
+    }
+
+    addMeasurement(measurement);
+}
+
+void EPubBenchmark::addMeasurement(const Measurement &measurement)
+{
+    if (measurement.samples.isEmpty()) {
+        return;
+    }
+
+    QVector<qint64> samples = measurement.samples;
+    std::sort(samples.begin(), samples.end());
+
+    qint64 total = 0;
+    for (const qint64 sample : samples) {
+        total += sample;
+    }
+
+    const double median = samples[samples.count() / 2] / 1000000.;
+
+    QJsonObject object;
+    object["name"] = measurement.name;
+    object["samples"] = samples.count();
+    object["minMs"] = samples.first() / 1000000.;
+    object["medianMs"] = median;
+    object["meanMs"] = total / 1000000. / samples.count();
+    object["maxMs"] = samples.last() / 1000000.;
+
+    if (measurement.operations > 0 && median > 0) {
+        object["operations"] = measurement.operations;
+        object["operationsPerSecond"] = measurement.operations * 1000. / median;
+    }
+    if (measurement.bytes > 0 && median > 0) {
+        object["bytes"] = measurement.bytes;
+        object["megabytesPerSecond"] = measurement.bytes / (1024. * 1024.) * 1000. / median;
+    }
+    if (measurement.allocations >= 0) {
+        object["allocations"] = measurement.allocations;
+        if (measurement.operations > 0) {
+            object["allocationsPerOperation"] = double(measurement.allocations) / measurement.operations;
+        }
+    }
+
+    m_results.append(object);
+}
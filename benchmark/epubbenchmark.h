@@ -0,0 +1,50 @@
+#ifndef EPUBBENCHMARK_H
+#define EPUBBENCHMARK_H
+
+#include <QSize>
+#include <QString>
+#include <QVector>
+#include <QJsonArray>
+#include <QJsonObject>
+
+// Runs the individual loading steps of EPubContainer and EPubDocument a
+// number of times and collects the timings as JSON.
+class EPubBenchmark
+{
+public:
+    EPubBenchmark(const QString &path, int iterations);
+
+    void setPageSize(const QSize &size) { m_pageSize = size; }
+
+    bool run();
+
+    QJsonObject results() const;
+
+private:
+    struct Measurement {
+        QString name;
+        QVector<qint64> samples; // nanoseconds
+        qint64 operations = 0; // per sample, used for throughput
+        qint64 bytes = 0; // per sample, used for throughput
+        qint64 allocations = -1; // per sample, if counted
+    };
+
+    void benchmarkOpenFile();
+    void benchmarkParseContentFile();
+    void benchmarkGetFile();
+    void benchmarkGetImage();
+    void benchmarkRenderSvgs();
+    void benchmarkPreprocessChapters();
+    void benchmarkLoadDocument();
+
+    void addMeasurement(const Measurement &measurement);
+
+    QString m_path;
+    int m_iterations;
+    QSize m_pageSize;
+
+    QJsonArray m_results;
+    bool m_failed;
+};
+
+#endif // EPUBBENCHMARK_H
@@ -0,0 +1,228 @@
+#include "epubgenerator.h"
+
+#include <KZip>
+
+#include <QBuffer>
+#include <QDebug>
+#include <QImage>
+#include <QPainter>
+#include <QLinearGradient>
+
+static const char *s_words[] = {
+    "lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing", "elit",
+    "sed", "do", "eiusmod", "tempor", "incididunt", "ut", "labore", "et", "dolore",
+    "magna", "aliqua", "enim", "ad", "minim", "veniam", "quis", "nostrud",
+    "exercitation", "ullamco", "laboris", "nisi", "aliquip", "ex", "ea", "commodo"
+};
+static const int s_wordCount = sizeof(s_words) / sizeof(s_words[0]);
+
+QVariantMap EpubGenerator::Shape::toVariantMap() const
+{
+    QVariantMap map;
+    map["chapters"] = chapterCount;
+    map["chapterSize"] = chapterSize;
+    map["images"] = imageCount;
+    map["imageSize"] = imageSize;
+    map["svgs"] = svgCount;
+    map["cssRules"] = cssRuleCount;
+    map["extraManifestItems"] = extraManifestItems;
+    map["seed"] = seed;
+    return map;
+}
+
+EpubGenerator::EpubGenerator(const Shape &shape) :
+    m_shape(shape),
+    m_randomState(shape.seed)
+{
+}
+
+bool EpubGenerator::generate(const QString &path)
+{
+    m_randomState = m_shape.seed;
+
+    KZip zip(path);
+    if (!zip.open(QIODevice::WriteOnly)) {
+        qWarning() << "Unable to open" << path << "for writing";
+        return false;
+    }
+
+    // The mimetype must be the first file, and stored uncompressed
+    zip.setCompression(KZip::NoCompression);
+    bool success = zip.writeFile("mimetype", QByteArray("application/epub+zip"));
+    zip.setCompression(KZip::DeflateCompression);
+
+    success = success && zip.writeFile("META-INF/container.xml", createContainer());
+    success = success && zip.writeFile(contentFilePath(), createContentFile());
+    success = success && zip.writeFile("OEBPS/style.css", createStylesheet());
+
+    for (int i=0; i<m_shape.chapterCount && success; i++) {
+        success = zip.writeFile(QString("OEBPS/chapter%1.xhtml").arg(i), createChapter(i));
+    }
+
+    // Images are already compressed, like in real books
+    zip.setCompression(KZip::NoCompression);
+    for (int i=0; i<m_shape.imageCount && success; i++) {
+        success = zip.writeFile(QString("OEBPS/images/image%1.png").arg(i), createImage(i));
+    }
+    zip.setCompression(KZip::DeflateCompression);
+
+    for (int i=0; i<m_shape.extraManifestItems && success; i++) {
+        success = zip.writeFile(QString("OEBPS/misc/data%1.bin").arg(i), QByteArray::number(i));
+    }
+
+    if (!success) {
+        qWarning() << "Failed to write contents of" << path;
+    }
+
+    return zip.close() && success;
+}
+
+QByteArray EpubGenerator::createContainer() const
+{
+    return "<?xml version=\"1.0\"?>\n"
+           "<container version=\"1.0\" xmlns=\"urn:oasis:names:tc:opendocument:xmlns:container\">\n"
+           "  <rootfiles>\n"
+           "    <rootfile full-path=\"" + contentFilePath().toUtf8() + "\" media-type=\"application/oebps-package+xml\"/>\n"
+           "  </rootfiles>\n"
+           "</container>\n";
+}
+
+QByteArray EpubGenerator::createContentFile() const
+{
+    QByteArray data;
+    data += "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+            "<package xmlns=\"http://www.idpf.org/2007/opf\" version=\"2.0\" unique-identifier=\"bookid\">\n"
+            "  <metadata xmlns:dc=\"http://purl.org/dc/elements/1.1/\">\n"
+            "    <dc:title>Synthetic benchmark book</dc:title>\n"
+            "    <dc:language>en</dc:language>\n"
+            "    <dc:identifier id=\"bookid\">urn:uuid:epubreader-benchmark</dc:identifier>\n"
+            "  </metadata>\n"
+            "  <manifest>\n"
+            "    <item id=\"style\" href=\"style.css\" media-type=\"text/css\"/>\n";
+
+    for (int i=0; i<m_shape.chapterCount; i++) {
+        data += "    <item id=\"chapter" + QByteArray::number(i) + "\" href=\"chapter" + QByteArray::number(i) + ".xhtml\" media-type=\"application/xhtml+xml\"/>\n";
+    }
+    for (int i=0; i<m_shape.imageCount; i++) {
+        data += "    <item id=\"image" + QByteArray::number(i) + "\" href=\"images/image" + QByteArray::number(i) + ".png\" media-type=\"image/png\"/>\n";
+    }
+    for (int i=0; i<m_shape.extraManifestItems; i++) {
+        data += "    <item id=\"data" + QByteArray::number(i) + "\" href=\"misc/data" + QByteArray::number(i) + ".bin\" media-type=\"application/octet-stream\"/>\n";
+    }
+
+    data += "  </manifest>\n"
+            "  <spine>\n";
+    for (int i=0; i<m_shape.chapterCount; i++) {
+        data += "    <itemref idref=\"chapter" + QByteArray::number(i) + "\"/>\n";
+    }
+    data += "  </spine>\n"
+            "</package>\n";
+
+    return data;
+}
+
+QByteArray EpubGenerator::createStylesheet() const
+{
+    QByteArray data;
+    data += "body { font-family: serif; margin: 1em; }\n";
+    for (int i=0; i<m_shape.cssRuleCount; i++) {
+        data += "p.style" + QByteArray::number(i) + ", div.style" + QByteArray::number(i) + " > span {"
+                " color: #" + QByteArray::number(0x100000 + i * 97 % 0xefffff, 16) + ";"
+                " margin-left: " + QByteArray::number(i % 4) + "em;"
+                " font-size: " + QByteArray::number(90 + i % 20) + "%; }\n";
+    }
+    return data;
+}
+
+QByteArray EpubGenerator::createChapter(int index)
+{
+    QByteArray data;
+    data.reserve(m_shape.chapterSize + 1024);
+
+    data += "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+            "<html xmlns=\"http://www.w3.org/1999/xhtml\" xmlns:xlink=\"http://www.w3.org/1999/xlink\">\n"
+            "<head><title>Chapter " + QByteArray::number(index) + "</title>"
+            "<link rel=\"stylesheet\" type=\"text/css\" href=\"style.css\"/></head>\n"
+            "<body>\n"
+            "<h1 id=\"chapter" + QByteArray::number(index) + "\">Chapter " + QByteArray::number(index) + "</h1>\n";
+
+    // Spread images and SVGs evenly over the chapters
+    for (int i=index; i<m_shape.imageCount; i += m_shape.chapterCount) {
+        data += "<p><img src=\"images/image" + QByteArray::number(i) + ".png\" alt=\"Image " + QByteArray::number(i) + "\"/></p>\n";
+    }
+    for (int i=index; i<m_shape.svgCount; i += m_shape.chapterCount) {
+        data += createSvg(i);
+    }
+
+    const int textStart = data.size();
+    int paragraph = 0;
+    while (data.size() - textStart < m_shape.chapterSize) {
+        data += "<p";
+        if (m_shape.cssRuleCount > 0) {
+            data += " class=\"style" + QByteArray::number(nextRandom() % m_shape.cssRuleCount) + "\"";
+        }
+        data += " id=\"p" + QByteArray::number(paragraph++) + "\">";
+
+        const int wordCount = 50 + nextRandom() % 100;
+        for (int i=0; i<wordCount; i++) {
+            const quint32 random = nextRandom();
+            if (random % 37 == 0) {
+                data += "<em>";
+                data += s_words[random % s_wordCount];
+                data += "</em> ";
+            } else {
+                data += s_words[random % s_wordCount];
+                data += ' ';
+            }
+        }
+        data += "</p>\n";
+    }
+
+    data += "</body>\n</html>\n";
+
+    return data;
+}
+
+QByteArray EpubGenerator::createImage(int index) const
+{
+    QImage image(m_shape.imageSize, m_shape.imageSize, QImage::Format_RGB32);
+
+    // Something that doesn't compress to nothing, but is cheap to create
+    QPainter painter(&image);
+    QLinearGradient gradient(0, 0, image.width(), image.height());
+    gradient.setColorAt(0, QColor::fromHsv(index * 37 % 360, 200, 255));
+    gradient.setColorAt(1, QColor::fromHsv(index * 91 % 360, 255, 128));
+    painter.fillRect(image.rect(), gradient);
+    painter.drawText(image.rect(), Qt::AlignCenter, QString::number(index));
+    painter.end();
+
+    QByteArray data;
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::WriteOnly);
+    image.save(&buffer, "PNG");
+
+    return data;
+}
+
+QByteArray EpubGenerator::createSvg(int index) const
+{
+    QByteArray data;
+    data += "<div><svg xmlns=\"http://www.w3.org/2000/svg\" version=\"1.1\" viewBox=\"0 0 400 300\">\n";
+    for (int i=0; i<20; i++) {
+        data += "  <circle cx=\"" + QByteArray::number((index * 31 + i * 17) % 400) + "\""
+                " cy=\"" + QByteArray::number((index * 13 + i * 23) % 300) + "\""
+                " r=\"" + QByteArray::number(10 + i * 3) + "\""
+                " fill=\"#" + QByteArray::number(0x100000 + (index + i) * 4099 % 0xefffff, 16) + "\""
+                " fill-opacity=\"0.5\"/>\n";
+    }
+    data += "  <text x=\"20\" y=\"280\" font-size=\"24\">Figure " + QByteArray::number(index) + "</text>\n";
+    data += "</svg></div>\n";
+    return data;
+}
+
+quint32 EpubGenerator::nextRandom()
+{
+    // Plain LCG, we only need it to be deterministic between runs
+    m_randomState = m_randomState * 1103515245 + 12345;
+    return (m_randomState >> 16) & 0x7fff;
+}
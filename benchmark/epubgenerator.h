@@ -0,0 +1,48 @@
+#ifndef EPUBGENERATOR_H
+#define EPUBGENERATOR_H
+
+#include <QString>
+#include <QStringList>
+#include <QVariantMap>
+
+class KZip;
+
+// Writes synthetic EPUB files with a controllable shape, so the benchmark
+// can exercise the loading code without depending on real books.
+class EpubGenerator
+{
+public:
+    struct Shape {
+        int chapterCount = 20;
+        int chapterSize = 32 * 1024; // bytes of text per chapter
+        int imageCount = 10;
+        int imageSize = 1024; // width/height in pixels
+        int svgCount = 10;
+        int cssRuleCount = 50;
+        int extraManifestItems = 0; // items that are only in the manifest
+        quint32 seed = 1;
+
+        QVariantMap toVariantMap() const;
+    };
+
+    explicit EpubGenerator(const Shape &shape);
+
+    bool generate(const QString &path);
+
+    static QString contentFilePath() { return QStringLiteral("OEBPS/content.opf"); }
+
+private:
+    QByteArray createContainer() const;
+    QByteArray createContentFile() const;
+    QByteArray createStylesheet() const;
+    QByteArray createChapter(int index);
+    QByteArray createImage(int index) const;
+    QByteArray createSvg(int index) const;
+
+    quint32 nextRandom();
+
+    Shape m_shape;
+    quint32 m_randomState;
+};
+
+#endif // EPUBGENERATOR_H
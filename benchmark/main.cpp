@@ -0,0 +1,125 @@
+#include "epubbenchmark.h"
+#include "epubgenerator.h"
+
+#include <QGuiApplication>
+#include <QCommandLineParser>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QTemporaryDir>
+
+static bool s_verbose = false;
+
+static void messageHandler(QtMsgType type, const QMessageLogContext &context, const QString &message)
+{
+    Q_UNUSED(context);
+
+    // The loading code is very chatty, and we want clean output
+    if (type == QtDebugMsg && !s_verbose) {
+        return;
+    }
+    fprintf(stderr, "%s\n", qPrintable(message));
+}
+
+int main(int argc, char *argv[])
+{
+    // Should be able to run on build machines without a display
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+
+    QGuiApplication app(argc, argv);
+    app.setApplicationName("epubbenchmark");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Benchmarks loading of synthetic or existing EPUB files");
+    parser.addHelpOption();
+
+    EpubGenerator::Shape shape;
+    const QCommandLineOption chaptersOption("chapters", "Number of chapters.", "count", QString::number(shape.chapterCount));
+    const QCommandLineOption chapterSizeOption("chapter-size", "Size of text in each chapter, in kilobytes.", "kb", QString::number(shape.chapterSize / 1024));
+    const QCommandLineOption imagesOption("images", "Number of images.", "count", QString::number(shape.imageCount));
+    const QCommandLineOption imageSizeOption("image-size", "Width and height of images, in pixels.", "pixels", QString::number(shape.imageSize));
+    const QCommandLineOption svgsOption("svgs", "Number of inline SVGs.", "count", QString::number(shape.svgCount));
+    const QCommandLineOption cssRulesOption("css-rules", "Number of rules in the stylesheet.", "count", QString::number(shape.cssRuleCount));
+    const QCommandLineOption manifestOption("manifest-extra", "Number of extra manifest items not in the spine.", "count", QString::number(shape.extraManifestItems));
+    const QCommandLineOption seedOption("seed", "Seed for the generated content.", "seed", QString::number(shape.seed));
+    const QCommandLineOption iterationsOption("iterations", "Number of times to run each benchmark.", "count", "5");
+    const QCommandLineOption outputOption({"o", "output"}, "Write JSON results to file instead of stdout.", "file");
+    const QCommandLineOption keepOption("keep", "Write the generated EPUB to this path and keep it.", "file");
+    const QCommandLineOption verboseOption({"v", "verbose"}, "Don't suppress debug output.");
+    parser.addOptions({chaptersOption, chapterSizeOption, imagesOption, imageSizeOption, svgsOption,
+                       cssRulesOption, manifestOption, seedOption, iterationsOption, outputOption,
+                       keepOption, verboseOption});
+    parser.addPositionalArgument("files", "Existing EPUB files to benchmark instead of a generated one.", "[files...]");
+    parser.process(app);
+
+    s_verbose = parser.isSet(verboseOption);
+    qInstallMessageHandler(messageHandler);
+
+    shape.chapterCount = qMax(1, parser.value(chaptersOption).toInt());
+    shape.chapterSize = parser.value(chapterSizeOption).toInt() * 1024;
+    shape.imageCount = parser.value(imagesOption).toInt();
+    shape.imageSize = qMax(1, parser.value(imageSizeOption).toInt());
+    shape.svgCount = parser.value(svgsOption).toInt();
+    shape.cssRuleCount = parser.value(cssRulesOption).toInt();
+    shape.extraManifestItems = parser.value(manifestOption).toInt();
+    shape.seed = parser.value(seedOption).toUInt();
+    const int iterations = parser.value(iterationsOption).toInt();
+
+    QJsonArray runs;
+    bool success = true;
+
+    const QStringList files = parser.positionalArguments();
+    if (files.isEmpty()) {
+        QTemporaryDir temporaryDir;
+        QString path = parser.value(keepOption);
+        if (path.isEmpty()) {
+            path = temporaryDir.filePath("synthetic.epub");
+        }
+
+        EpubGenerator generator(shape);
+        if (!generator.generate(path)) {
+            qWarning() << "Failed to generate" << path;
+            return 1;
+        }
+
+        EPubBenchmark benchmark(path, iterations);
+        success = benchmark.run();
+
+        QJsonObject result = benchmark.results();
+        result["shape"] = QJsonObject::fromVariantMap(shape.toVariantMap());
+        result["fileSize"] = QFileInfo(path).size();
+        runs.append(result);
+    } else {
+        for (const QString &path : files) {
+            EPubBenchmark benchmark(path, iterations);
+            success = benchmark.run() && success;
+
+            QJsonObject result = benchmark.results();
+            result["fileSize"] = QFileInfo(path).size();
+            runs.append(result);
+        }
+    }
+
+    QJsonObject output;
+    output["benchmark"] = "epubreader";
+    output["qtVersion"] = qVersion();
+    output["runs"] = runs;
+    const QByteArray json = QJsonDocument(output).toJson();
+
+    if (parser.isSet(outputOption)) {
+        QFile file(parser.value(outputOption));
+        if (!file.open(QIODevice::WriteOnly)) {
+            qWarning() << "Unable to open" << file.fileName() << "for writing";
+            return 1;
+        }
+        file.write(json);
+    } else {
+        fprintf(stdout, "%s", json.constData());
+    }
+
+    return success ? 0 : 1;
+}
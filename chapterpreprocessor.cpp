@@ -0,0 +1,679 @@
+#include "chapterpreprocessor.h"
+
+#include "epubcontainer.h"
+
+#include <QDebug>
+#include <QHash>
+#include <QSet>
+#include <QXmlStreamReader>
+#include <QXmlStreamWriter>
+
+namespace {
+// How far past the segment size it can grow without a good place to split,
+// after that it is split anyway
+const int s_maximumSegmentFactor = 4;
+}
+
+ChapterPreprocessor::ChapterPreprocessor() :
+    m_outputFormat(HtmlSegments),
+    m_segmentSize(DefaultSegmentSize),
+    m_startedOutput(false),
+    m_pendingSpace(false),
+    m_inHead(false),
+    m_inBody(false),
+    m_inStyle(false),
+    m_skipDepth(0),
+    m_svgDepth(0),
+    m_stopped(false)
+{
+}
+
+ChapterPreprocessor::~ChapterPreprocessor()
+{
+}
+
+bool ChapterPreprocessor::process(EpubChunkReader &reader, const QString &chapterPath)
+{
+    m_chapterUrl = QUrl(chapterPath);
+    m_errorString.clear();
+    m_head.resize(0);
+    m_bodyStartTag.resize(0);
+    m_bodyStartTag += QLatin1String("<body>");
+    m_segment.resize(0);
+    m_reopenTags.resize(0);
+    m_openTags.resize(0);
+    m_openElements.clear();
+    m_startedOutput = false;
+    m_pendingSpace = false;
+    m_inHead = false;
+    m_inBody = false;
+    m_inStyle = false;
+    m_skipDepth = 0;
+    m_svgDepth = 0;
+    m_svgWriter.reset();
+    m_stopped = false;
+
+    if (!reader.isValid()) {
+        m_errorString = "Unable to read " + chapterPath;
+        return false;
+    }
+
+    if (m_xml) {
+        m_xml->clear();
+    } else {
+        m_xml.reset(new QXmlStreamReader);
+    }
+    QXmlStreamReader &xml = *m_xml;
+
+    // Keep prefixes and xmlns attributes as they are, the SVGs need them
+    xml.setNamespaceProcessing(false);
+
+    while (!m_stopped) {
+        const QXmlStreamReader::TokenType token = xml.readNext();
+
+        if (token == QXmlStreamReader::Invalid) {
+            // Feed it more data as it needs it
+            if (xml.error() == QXmlStreamReader::PrematureEndOfDocumentError && !reader.atEnd()) {
+                xml.addData(reader.readChunk());
+                continue;
+            }
+            break;
+        }
+
+        if (token == QXmlStreamReader::EndDocument) {
+            break;
+        }
+
+        switch(token) {
+        case QXmlStreamReader::StartElement:
+            handleStartElement(xml);
+            break;
+        case QXmlStreamReader::EndElement:
+            handleEndElement(xml);
+            break;
+        case QXmlStreamReader::Characters:
+            handleText(xml.text(), false);
+            break;
+        case QXmlStreamReader::EntityReference:
+            if (m_svgDepth > 0) {
+                m_svgWriter->writeEntityReference(xml.name().toString());
+            } else if (m_outputFormat == PlainText) {
+                const QString text = decodeEntity(xml.name().toString());
+                handleText(QStringRef(&text), false);
+            } else {
+                const QString entity = QLatin1Char('&') + xml.name().toString() + QLatin1Char(';');
+                handleText(QStringRef(&entity), true);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (m_stopped) {
+        return true;
+    }
+
+    // We can only know that the document is done when we run out of data
+    const bool truncated = xml.error() == QXmlStreamReader::PrematureEndOfDocumentError && (m_inBody || m_svgDepth > 0);
+    if ((xml.hasError() && xml.error() != QXmlStreamReader::PrematureEndOfDocumentError) || truncated) {
+        m_errorString = QString("%1 at line %2 in %3").arg(xml.errorString()).arg(xml.lineNumber()).arg(chapterPath);
+    }
+
+    // Use whatever we got, even if it is broken
+    if (m_svgDepth > 0) {
+        m_svgDepth = 0;
+        finishSvg();
+    }
+    flushSegment(true);
+
+    return m_errorString.isEmpty();
+}
+
+void ChapterPreprocessor::handleStartElement(QXmlStreamReader &xml)
+{
+    const QString name = elementName(xml.qualifiedName());
+
+    if (m_svgDepth > 0) {
+        writeSvgStartElement(xml, name);
+        return;
+    }
+
+    if (m_skipDepth > 0 || name == "script" || (name == "svg" && m_outputFormat == PlainText)) {
+        m_skipDepth++;
+        return;
+    }
+
+    if (name == "svg") {
+        writeSvgStartElement(xml, name);
+        return;
+    }
+
+    if (name == "html") {
+        return;
+    }
+
+    if (name == "head") {
+        m_inHead = true;
+        return;
+    }
+
+    if (name == "body") {
+        m_inHead = false;
+        m_inBody = true;
+        m_bodyStartTag.resize(0);
+        writeStartTag(&m_bodyStartTag, name, xml.attributes(), false);
+        return;
+    }
+
+    if (m_inHead) {
+        // Only keep what affects the styling
+        if (m_outputFormat == PlainText) {
+            m_skipDepth++;
+        } else if (name == "link" && m_styleSheetLoader) {
+            const QXmlStreamAttributes attributes = xml.attributes();
+            if (attributes.value("rel").contains(QLatin1String("stylesheet"), Qt::CaseInsensitive)) {
+                QString css = m_styleSheetLoader(resolvePath(attributes.value("href").toString()));
+                // So it can't end the <style> early
+                css.replace(QLatin1String("</"), QLatin1String("<\\/"));
+                m_head += QLatin1String("<style>");
+                m_head += css;
+                m_head += QLatin1String("</style>");
+            }
+        } else if (name == "link") {
+            writeStartTag(&m_head, name, xml.attributes(), true);
+        } else if (name == "style") {
+            writeStartTag(&m_head, name, xml.attributes(), false);
+            m_inStyle = true;
+        } else {
+            m_skipDepth++;
+        }
+        return;
+    }
+
+    if (!m_inBody) {
+        m_skipDepth++;
+        return;
+    }
+
+    if (m_outputFormat == PlainText) {
+        if (name == "br" || name == "li" || name == "tr") {
+            appendLineBreaks(1);
+        } else if (isBlockElement(name) || name == "hr") {
+            appendLineBreaks(2);
+        } else if ((name == "td" || name == "th") && !m_segment.isEmpty() && !m_segment.endsWith(QLatin1Char('\n'))) {
+            // Between the cells in a row
+            m_segment += QLatin1Char('\t');
+            m_pendingSpace = false;
+        }
+        return;
+    }
+
+    const bool isVoid = isVoidElement(name);
+    OpenElement element;
+    element.name = name;
+    element.reopenTagOffset = m_openTags.size();
+
+    // Only these need changes, the rest are copied straight from the reader
+    if (name == "img" || name == "a") {
+        Attributes attributes = readAttributes(xml);
+
+        if (name == "img") {
+            // Fix relative URLs, images are lazily loaded so the base URL might
+            // not be correct when they are loaded
+            for (QPair<QString, QString> &attribute : attributes) {
+                if (attribute.first == "src") {
+                    attribute.second = resolvePath(attribute.second);
+                }
+            }
+            if (m_imageHandler) {
+                m_imageHandler(attributes);
+            }
+        } else {
+            // So we know which file a link goes to
+            for (QPair<QString, QString> &attribute : attributes) {
+                if (attribute.first == "href") {
+                    attribute.second = resolvePath(attribute.second);
+                }
+            }
+            if (m_linkHandler) {
+                m_linkHandler(attributes);
+            }
+        }
+
+        writeStartTag(&m_segment, name, attributes, isVoid);
+        if (!isVoid) {
+            writeStartTag(&m_openTags, name, attributes, false, false);
+        }
+    } else {
+        const QXmlStreamAttributes attributes = xml.attributes();
+        writeStartTag(&m_segment, name, attributes, isVoid);
+        if (!isVoid) {
+            writeStartTag(&m_openTags, name, attributes, false, false);
+        }
+    }
+
+    // In case we need to continue the element in the next segment, without duplicating anchors
+    if (!isVoid) {
+        m_openElements.append(element);
+    }
+}
+
+void ChapterPreprocessor::handleEndElement(QXmlStreamReader &xml)
+{
+    if (m_svgDepth > 0) {
+        m_svgWriter->writeEndElement();
+        m_svgDepth--;
+        if (m_svgDepth == 0) {
+            finishSvg();
+        }
+        return;
+    }
+
+    if (m_skipDepth > 0) {
+        m_skipDepth--;
+        return;
+    }
+
+    const QString name = elementName(xml.qualifiedName());
+
+    if (name == "head") {
+        m_inHead = false;
+        return;
+    }
+
+    if (name == "body") {
+        m_inBody = false;
+        return;
+    }
+
+    if (m_inHead) {
+        if (name == "style") {
+            m_head += QLatin1String("</style>");
+            m_inStyle = false;
+        }
+        return;
+    }
+
+    if (!m_inBody) {
+        return;
+    }
+
+    if (m_outputFormat == PlainText) {
+        if (isBlockElement(name)) {
+            appendLineBreaks(2);
+            if (m_segment.size() >= m_segmentSize) {
+                flushSegment();
+            }
+        }
+        splitOversizedSegment();
+        return;
+    }
+
+    if (isVoidElement(name) || m_openElements.isEmpty()) {
+        return;
+    }
+
+    m_openTags.truncate(m_openElements.last().reopenTagOffset);
+    m_openElements.removeLast();
+    m_segment += QLatin1String("</");
+    m_segment += name;
+    m_segment += QLatin1Char('>');
+
+    if (m_segment.size() >= m_segmentSize && isBlockElement(name) && canSplit()) {
+        flushSegment();
+    } else {
+        splitOversizedSegment();
+    }
+}
+
+void ChapterPreprocessor::handleText(const QStringRef &text, bool raw)
+{
+    if (m_svgDepth > 0) {
+        m_svgWriter->writeCharacters(text.toString());
+        return;
+    }
+
+    if (m_skipDepth > 0) {
+        return;
+    }
+
+    if (m_inHead) {
+        // CSS isn't escaped
+        if (m_inStyle) {
+            m_head += text;
+        }
+        return;
+    }
+
+    if (!m_inBody) {
+        return;
+    }
+
+    if (m_outputFormat == PlainText) {
+        appendPlainText(text);
+    } else if (raw) {
+        m_segment += text;
+    } else {
+        appendEscaped(&m_segment, text);
+    }
+
+    splitOversizedSegment();
+}
+
+void ChapterPreprocessor::appendPlainText(const QStringRef &text)
+{
+    // Collapse all whitespace, like a browser would
+    for (const QChar character : text) {
+        if (character.isSpace()) {
+            m_pendingSpace = true;
+            continue;
+        }
+
+        if (m_pendingSpace && !m_segment.isEmpty() && !m_segment.endsWith(QLatin1Char('\n')) && !m_segment.endsWith(QLatin1Char('\t'))) {
+            m_segment += QLatin1Char(' ');
+        }
+        m_pendingSpace = false;
+        m_segment += character;
+    }
+}
+
+void ChapterPreprocessor::appendLineBreaks(int count)
+{
+    m_pendingSpace = false;
+
+    // No empty lines at the start, and don't stack them up
+    if (m_segment.isEmpty()) {
+        return;
+    }
+
+    int existing = 0;
+    while (existing < count && existing < m_segment.size() && m_segment.at(m_segment.size() - 1 - existing) == QLatin1Char('\n')) {
+        existing++;
+    }
+    for (int i=existing; i<count; i++) {
+        m_segment += QLatin1Char('\n');
+    }
+}
+
+void ChapterPreprocessor::writeSvgStartElement(QXmlStreamReader &xml, const QString &name)
+{
+    if (m_svgDepth == 0) {
+        m_svg.clear();
+        m_svgWriter.reset(new QXmlStreamWriter(&m_svg));
+    }
+    m_svgDepth++;
+
+    m_svgWriter->writeStartElement(xml.qualifiedName().toString());
+
+    Attributes attributes = readAttributes(xml);
+    for (QPair<QString, QString> &attribute : attributes) {
+        // QImage which QtSvg uses isn't able to read files from inside the archive, so embed image data inline
+        if (name == "image" && (attribute.first == "xlink:href" || attribute.first == "href") &&
+                !attribute.second.startsWith("data:") && m_resourceLoader) {
+            const QByteArray fileData = m_resourceLoader(resolvePath(attribute.second));
+            attribute.second = QString::fromLatin1("data:image/jpeg;base64," + fileData.toBase64());
+        }
+        m_svgWriter->writeAttribute(attribute.first, attribute.second);
+    }
+}
+
+void ChapterPreprocessor::finishSvg()
+{
+    m_svgWriter.reset();
+
+    // QTextDocument isn't fond of SVGs, so they are stored separately, and
+    // it gets an <img> instead
+    if (m_inBody && m_svgHandler) {
+        const QString src = m_svgHandler(m_svg);
+        if (!src.isEmpty()) {
+            Attributes attributes({qMakePair(QString("src"), src)});
+            if (m_imageHandler) {
+                m_imageHandler(attributes);
+            }
+            writeStartTag(&m_segment, "img", attributes, true);
+        }
+    }
+
+    m_svg.clear();
+}
+
+void ChapterPreprocessor::writeStartTag(QString *output, const QString &name, const Attributes &attributes, bool isEmpty, bool withIds)
+{
+    *output += QLatin1Char('<');
+    *output += name;
+    for (const QPair<QString, QString> &attribute : attributes) {
+        if (!withIds && attribute.first == QLatin1String("id")) {
+            continue;
+        }
+        *output += QLatin1Char(' ');
+        *output += attribute.first;
+        *output += QLatin1String("=\"");
+        appendEscaped(output, QStringRef(&attribute.second));
+        *output += QLatin1Char('"');
+    }
+    *output += isEmpty ? QLatin1String(" />") : QLatin1String(">");
+}
+
+void ChapterPreprocessor::writeStartTag(QString *output, const QString &name, const QXmlStreamAttributes &attributes, bool isEmpty, bool withIds)
+{
+    *output += QLatin1Char('<');
+    *output += name;
+    for (const QXmlStreamAttribute &attribute : attributes) {
+        if (!withIds && attribute.qualifiedName() == QLatin1String("id")) {
+            continue;
+        }
+        *output += QLatin1Char(' ');
+        *output += attribute.qualifiedName();
+        *output += QLatin1String("=\"");
+        appendEscaped(output, attribute.value());
+        *output += QLatin1Char('"');
+    }
+    *output += isEmpty ? QLatin1String(" />") : QLatin1String(">");
+}
+
+void ChapterPreprocessor::flushSegment(bool final)
+{
+    if (m_stopped) {
+        m_segment.resize(0);
+        return;
+    }
+
+    if (m_outputFormat == PlainText) {
+        if (!m_segment.isEmpty() && m_segmentHandler) {
+            m_segmentHandler(m_segment);
+        }
+        m_segment.resize(0);
+        return;
+    }
+
+    m_output.resize(0);
+
+    if (m_outputFormat == ContinuousHtml) {
+        if (!m_startedOutput) {
+            if (m_segment.isEmpty() && !final) {
+                return;
+            }
+            m_output += QLatin1String("<html><head>");
+            m_output += m_head;
+            m_output += QLatin1String("</head>");
+            m_output += m_bodyStartTag;
+            m_startedOutput = true;
+        }
+        m_output += m_segment;
+        if (final) {
+            m_output += QLatin1String("</body></html>");
+        }
+        m_segment.resize(0);
+
+        if (!m_output.isEmpty() && m_segmentHandler) {
+            m_segmentHandler(m_output);
+        }
+        return;
+    }
+
+    if (m_segment.isEmpty()) {
+        return;
+    }
+
+    m_output.reserve(m_head.size() + m_bodyStartTag.size() + m_reopenTags.size() + m_segment.size() + 64);
+    m_output += QLatin1String("<html><head>");
+    m_output += m_head;
+    m_output += QLatin1String("</head>");
+    m_output += m_bodyStartTag;
+    m_output += m_reopenTags;
+    m_output += m_segment;
+
+    // Close everything still open, and open it again for the next segment
+    for (int i=m_openElements.count() - 1; i>=0; i--) {
+        m_output += QLatin1String("</");
+        m_output += m_openElements[i].name;
+        m_output += QLatin1Char('>');
+    }
+    m_reopenTags.resize(0);
+    m_reopenTags += m_openTags;
+    m_output += QLatin1String("</body></html>");
+
+    m_segment.resize(0);
+
+    if (m_segmentHandler) {
+        m_segmentHandler(m_output);
+    }
+}
+
+void ChapterPreprocessor::splitOversizedSegment()
+{
+    // One huge paragraph, table or list would otherwise end up in a single
+    // segment, so it is split where it shows instead. The open elements are
+    // closed and opened again like for any other split.
+    if (m_segment.size() < qint64(m_segmentSize) * s_maximumSegmentFactor) {
+        return;
+    }
+
+    if (m_outputFormat != PlainText) {
+        flushSegment();
+        return;
+    }
+
+    // The whitespace handling looks at the end of the segment, so it stays
+    const int kept = qMin(2, m_segment.size());
+    const QString tail = m_segment.right(kept);
+    m_segment.chop(kept);
+    flushSegment();
+    m_segment += tail;
+}
+
+bool ChapterPreprocessor::canSplit() const
+{
+    // Splitting these would visibly break them
+    static const QSet<QString> unsplittable({"table", "ul", "ol", "dl", "pre"});
+    for (const OpenElement &element : m_openElements) {
+        if (unsplittable.contains(element.name)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+QString ChapterPreprocessor::elementName(const QStringRef &qualifiedName)
+{
+    // Without the prefix, and in lower case
+    m_nameBuffer.resize(0);
+    for (int i=qualifiedName.indexOf(QLatin1Char(':')) + 1; i<qualifiedName.size(); i++) {
+        m_nameBuffer += qualifiedName.at(i).toLower();
+    }
+
+    // A copy of its own, the buffer is reused
+    if (!m_elementNames.contains(m_nameBuffer)) {
+        m_elementNames.insert(QString(m_nameBuffer.constData(), m_nameBuffer.size()));
+    }
+    return *m_elementNames.constFind(m_nameBuffer);
+}
+
+QString ChapterPreprocessor::resolvePath(const QString &path) const
+{
+    return m_chapterUrl.resolved(QUrl(path)).toString();
+}
+
+ChapterPreprocessor::Attributes ChapterPreprocessor::readAttributes(const QXmlStreamReader &xml)
+{
+    const QXmlStreamAttributes xmlAttributes = xml.attributes();
+
+    Attributes attributes;
+    attributes.reserve(xmlAttributes.count());
+    for (const QXmlStreamAttribute &attribute : xmlAttributes) {
+        attributes.append(qMakePair(attribute.qualifiedName().toString(), attribute.value().toString()));
+    }
+    return attributes;
+}
+
+void ChapterPreprocessor::appendEscaped(QString *output, const QStringRef &text)
+{
+    // Same as QString::toHtmlEscaped(), without the temporary string
+    int start = 0;
+    for (int i=0; i<text.size(); i++) {
+        const char *replacement = nullptr;
+        switch (text.at(i).unicode()) {
+        case '<':
+            replacement = "&lt;";
+            break;
+        case '>':
+            replacement = "&gt;";
+            break;
+        case '&':
+            replacement = "&amp;";
+            break;
+        case '"':
+            replacement = "&quot;";
+            break;
+        default:
+            continue;
+        }
+        output->append(text.constData() + start, i - start);
+        *output += QLatin1String(replacement);
+        start = i + 1;
+    }
+    output->append(text.constData() + start, text.size() - start);
+}
+
+bool ChapterPreprocessor::isVoidElement(const QString &name)
+{
+    static const QSet<QString> voidElements({
+        "area", "base", "br", "col", "embed", "hr", "img", "input",
+        "link", "meta", "param", "source", "track", "wbr"
+    });
+    return voidElements.contains(name);
+}
+
+QString ChapterPreprocessor::decodeEntity(const QString &name)
+{
+    // Only the common ones, XHTML usually has numeric references which the XML reader handles
+    static const QHash<QString, QString> entities({
+        {"nbsp", QString(QChar(0x00a0))},
+        {"amp", "&"},
+        {"lt", "<"},
+        {"gt", ">"},
+        {"quot", "\""},
+        {"apos", "'"},
+        {"shy", QString()},
+        {"ndash", QString(QChar(0x2013))},
+        {"mdash", QString(QChar(0x2014))},
+        {"lsquo", QString(QChar(0x2018))},
+        {"rsquo", QString(QChar(0x2019))},
+        {"ldquo", QString(QChar(0x201c))},
+        {"rdquo", QString(QChar(0x201d))},
+        {"hellip", QString(QChar(0x2026))},
+        {"copy", QString(QChar(0x00a9))}
+    });
+    return entities.value(name);
+}
+
+bool ChapterPreprocessor::isBlockElement(const QString &name)
+{
+    static const QSet<QString> blockElements({
+        "p", "div", "h1", "h2", "h3", "h4", "h5", "h6", "blockquote",
+        "section", "article", "aside", "header", "footer", "nav",
+        "figure", "ul", "ol", "dl", "table", "pre"
+    });
+    return blockElements.contains(name);
+}
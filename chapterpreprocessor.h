@@ -0,0 +1,145 @@
+#ifndef CHAPTERPREPROCESSOR_H
+#define CHAPTERPREPROCESSOR_H
+
+#include <QString>
+#include <QUrl>
+#include <QPair>
+#include <QSet>
+#include <QVector>
+#include <QScopedPointer>
+#include <functional>
+
+class EpubChunkReader;
+class QXmlStreamAttributes;
+class QXmlStreamReader;
+class QXmlStreamWriter;
+
+// Turns XHTML chapters into HTML that QTextDocument can swallow, while
+// reading them in chunks. Instead of one big string for the whole chapter
+// it hands out self contained segments of roughly segmentSize() characters,
+// split between block elements, so the memory use doesn't depend on the
+// size of the chapter. Elements that are too big for that are split in the
+// middle. Meant to be reused for all the chapters in a book, the buffers
+// are kept between them. That only saves the allocations made here, when
+// loading, QTextDocumentFragment::fromHtml() still allocates a lot more
+// for every segment.
+class ChapterPreprocessor
+{
+public:
+    typedef QVector<QPair<QString, QString>> Attributes;
+
+    enum { DefaultSegmentSize = 256 * 1024 };
+
+    enum OutputFormat {
+        HtmlSegments, // every segment is a complete HTML document
+        ContinuousHtml, // segments have to be concatenated
+        PlainText // just the text, with normalized whitespace
+    };
+
+    ChapterPreprocessor();
+    ~ChapterPreprocessor();
+
+    void setOutputFormat(OutputFormat format) { m_outputFormat = format; }
+    OutputFormat outputFormat() const { return m_outputFormat; }
+
+    void setSegmentSize(int characters) { m_segmentSize = characters; }
+    int segmentSize() const { return m_segmentSize; }
+
+    // Called for each <img>, with the src already resolved against the chapter path,
+    // and for the ones replacing SVGs
+    void setImageHandler(const std::function<void(Attributes &attributes)> &handler) { m_imageHandler = handler; }
+
+    // Called with the source of each inline SVG, returns the src for the <img> replacing it
+    void setSvgHandler(const std::function<QString(const QByteArray &svg)> &handler) { m_svgHandler = handler; }
+
+    // Called for each <a>, with the href already resolved against the chapter path
+    void setLinkHandler(const std::function<void(Attributes &attributes)> &handler) { m_linkHandler = handler; }
+
+    // Returns the contents of a file in the book, for images referenced from SVGs
+    void setResourceLoader(const std::function<QByteArray(const QString &path)> &loader) { m_resourceLoader = loader; }
+
+    // Called with the resolved path of each stylesheet <link>, returns the
+    // CSS to put in a <style> instead. Without it the <link> is kept.
+    void setStyleSheetLoader(const std::function<QString(const QString &path)> &loader) { m_styleSheetLoader = loader; }
+
+    // Called with each finished piece of HTML
+    void setSegmentHandler(const std::function<void(const QString &html)> &handler) { m_segmentHandler = handler; }
+
+    bool process(EpubChunkReader &reader, const QString &chapterPath);
+
+    // Can be called from the handlers, nothing more is handed out after it
+    void stop() { m_stopped = true; }
+    bool isStopped() const { return m_stopped; }
+
+    QString errorString() const { return m_errorString; }
+
+private:
+    struct OpenElement {
+        QString name;
+        int reopenTagOffset; // in m_openTags
+    };
+
+    void handleStartElement(QXmlStreamReader &xml);
+    void handleEndElement(QXmlStreamReader &xml);
+    void handleText(const QStringRef &text, bool raw);
+    void appendPlainText(const QStringRef &text);
+    void appendLineBreaks(int count);
+
+    void writeSvgStartElement(QXmlStreamReader &xml, const QString &name);
+    void finishSvg();
+
+    void writeStartTag(QString *output, const QString &name, const Attributes &attributes, bool isEmpty, bool withIds = true);
+    void writeStartTag(QString *output, const QString &name, const QXmlStreamAttributes &attributes, bool isEmpty, bool withIds = true);
+    void flushSegment(bool final = false);
+    void splitOversizedSegment();
+    bool canSplit() const;
+
+    QString elementName(const QStringRef &qualifiedName);
+    QString resolvePath(const QString &path) const;
+    static Attributes readAttributes(const QXmlStreamReader &xml);
+    static void appendEscaped(QString *output, const QStringRef &text);
+    static bool isVoidElement(const QString &name);
+    static bool isBlockElement(const QString &name);
+    static QString decodeEntity(const QString &name);
+
+    OutputFormat m_outputFormat;
+    int m_segmentSize;
+    std::function<void(Attributes &attributes)> m_imageHandler;
+    std::function<QString(const QByteArray &svg)> m_svgHandler;
+    std::function<void(Attributes &attributes)> m_linkHandler;
+    std::function<QByteArray(const QString &path)> m_resourceLoader;
+    std::function<QString(const QString &path)> m_styleSheetLoader;
+    std::function<void(const QString &html)> m_segmentHandler;
+
+    QUrl m_chapterUrl;
+    QString m_errorString;
+
+    // Emptied with resize(0) instead of clear(), so they keep their capacity
+    QString m_head;
+    QString m_bodyStartTag;
+    QString m_segment;
+    QString m_output;
+    QString m_reopenTags;
+    QString m_openTags; // the start tags of m_openElements, without ids
+    QVector<OpenElement> m_openElements;
+
+    QScopedPointer<QXmlStreamReader> m_xml;
+    QSet<QString> m_elementNames; // so we don't allocate a new string for every element
+    QString m_nameBuffer;
+
+    bool m_startedOutput;
+    bool m_pendingSpace;
+
+    bool m_inHead;
+    bool m_inBody;
+    bool m_inStyle;
+    int m_skipDepth; // inside something we don't want, like <script>
+
+    QByteArray m_svg;
+    QScopedPointer<QXmlStreamWriter> m_svgWriter;
+    int m_svgDepth;
+
+    bool m_stopped;
+};
+
+#endif // CHAPTERPREPROCESSOR_H
@@ -3,6 +3,7 @@
 #include <KZip>
 #include <KArchiveDirectory>
 #include <KArchiveFile>
+#include <KZipFileEntry>
 
 #include <QDebug>
 #include <QScopedPointer>
@@ -10,23 +11,126 @@
 #include <QDir>
 #include <QImage>
 #include <QImageReader>
+#include <QPointer>
+#include <QElapsedTimer>
+#include <algorithm>
+#include <functional>
+#include <limits>
 
 #define METADATA_FOLDER "META-INF"
 #define MIMETYPE_FILE "mimetype"
 #define CONTAINER_FILE "META-INF/container.xml"
 
+namespace {
+// Compression ratios above this are only plausible for zip bombs, for
+// anything large enough to matter
+const qint64 s_maximumCompressionRatio = 1000;
+const qint64 s_minimumSuspiciousSize = 16 * 1024 * 1024;
+
+// Makes sure a member doesn't inflate to more than the central directory
+// says, the decompression is aborted as soon as it does
+class GuardedDevice : public QIODevice
+{
+public:
+    GuardedDevice(QIODevice *device, qint64 size, const std::function<void()> &onExceeded,
+                  const QSharedPointer<EPubContainer::ResourceStatistics> &statistics) :
+        m_device(device),
+        m_size(size),
+        m_onExceeded(onExceeded),
+        m_statistics(statistics),
+        m_verified(false),
+        m_exceeded(false)
+    {
+        open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+    }
+
+    qint64 size() const override
+    {
+        return m_size;
+    }
+
+    bool seek(qint64 pos) override
+    {
+        return QIODevice::seek(pos) && m_device->seek(pos);
+    }
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override
+    {
+        if (m_exceeded) {
+            return -1;
+        }
+
+        QElapsedTimer timer;
+        if (m_statistics) {
+            timer.start();
+        }
+
+        const qint64 position = m_device->pos();
+        const qint64 bytesRead = m_device->read(data, qMin(maxSize, m_size - position));
+        if (bytesRead < 0) {
+            return bytesRead;
+        }
+
+        if (m_statistics) {
+            m_statistics->bytesInflated += bytesRead;
+            m_statistics->inflateTime += timer.nsecsElapsed();
+        }
+
+        // Only needs to be checked once, at the end
+        if (!m_verified && position + bytesRead >= m_size) {
+            char extra;
+            if (m_device->read(&extra, 1) == 1) {
+                m_exceeded = true;
+                setErrorString(QStringLiteral("Uncompressed data is larger than declared"));
+                m_onExceeded();
+                return -1;
+            }
+            m_verified = true;
+        }
+
+        return bytesRead;
+    }
+
+    qint64 writeData(const char *, qint64) override
+    {
+        return -1;
+    }
+
+private:
+    QScopedPointer<QIODevice> m_device;
+    qint64 m_size;
+    std::function<void()> m_onExceeded;
+    QSharedPointer<EPubContainer::ResourceStatistics> m_statistics;
+    bool m_verified;
+    bool m_exceeded;
+};
+}
+
 EPubContainer::EPubContainer(QObject *parent) : QObject(parent),
     m_archive(nullptr),
-    m_rootFolder(nullptr)
+    m_rootFolder(nullptr),
+    m_maximumFileSize(DefaultMaximumFileSize),
+    m_maximumTotalSize(DefaultMaximumTotalSize),
+    m_statisticsEnabled(qEnvironmentVariableIsSet("EPUBREADER_ARCHIVE_STATISTICS"))
 {
 }
 
 EPubContainer::~EPubContainer()
 {
+    if (m_statisticsEnabled && !m_statistics.isEmpty()) {
+        qInfo().noquote() << statisticsReport();
+    }
+
     delete m_archive;
 }
 
 bool EPubContainer::openFile(const QString path)
+{
+    return openArchive(path) && parseContents();
+}
+
+bool EPubContainer::openArchive(const QString &path)
 {
     delete m_archive;
 
@@ -44,6 +148,11 @@ bool EPubContainer::openFile(const QString path)
         return false;
     }
 
+    return checkArchiveSizes();
+}
+
+bool EPubContainer::parseContents()
+{
     if (!parseMimetype()) {
         return false;
     }
@@ -55,7 +164,7 @@ bool EPubContainer::openFile(const QString path)
     return true;
 }
 
-QSharedPointer<QIODevice> EPubContainer::getIoDevice(const QString &path)
+QSharedPointer<QIODevice> EPubContainer::getIoDevice(const QString &path, Consumer consumer)
 {
     const KArchiveFile *file = getFile(path);
     if (!file) {
@@ -63,30 +172,137 @@ QSharedPointer<QIODevice> EPubContainer::getIoDevice(const QString &path)
         return QSharedPointer<QIODevice>();
     }
 
-    return QSharedPointer<QIODevice>(file->createDevice());
+    return openDevice(file, path, consumer);
+}
+
+EpubChunkReader EPubContainer::getChunkReader(const QString &path, Consumer consumer, int chunkSize)
+{
+    return EpubChunkReader(getIoDevice(path, consumer), chunkSize);
+}
+
+QByteArray EPubContainer::readFile(const QString &path, Consumer consumer)
+{
+    const KArchiveFile *file = getFile(path);
+    if (!file) {
+        emit errorHappened(tr("Unable to open file %1").arg(path.left(100)));
+        return QByteArray();
+    }
+
+    // The maximum file size can be set higher than what fits in a
+    // QByteArray, the chunk readers don't need to hold all of it
+    if (file->size() > std::numeric_limits<int>::max()) {
+        emit errorHappened(tr("%1 is too large to read at once (%2 MB)").arg(path.left(100)).arg(file->size() / (1024 * 1024)));
+        return QByteArray();
+    }
+
+    QSharedPointer<QIODevice> ioDevice = openDevice(file, path, consumer);
+    if (!ioDevice) {
+        return QByteArray();
+    }
+
+    // Allocate everything up front from the size in the archive, instead of
+    // readAll() growing (and copying) the buffer as it goes
+    QByteArray data;
+    data.resize(int(file->size()));
+    const qint64 bytesRead = ioDevice->read(data.data(), data.size());
+    if (bytesRead < 0) {
+        emit errorHappened(tr("Unable to read file %1").arg(path.left(100)));
+        return QByteArray();
+    }
+    data.resize(bytesRead);
+
+    return data;
+}
+
+qint64 EPubContainer::getFileSize(const QString &path)
+{
+    const KArchiveFile *file = getFile(path);
+    if (!file) {
+        return -1;
+    }
+    return file->size();
+}
+
+EpubItem EPubContainer::getEpubItem(const QString &id) const
+{
+    EpubItem item;
+    const int index = findItem(id);
+    if (index != -1) {
+        item.path = itemPath(index).toString();
+        item.mimetype = m_mimetypes[m_manifest[index].mimetype];
+    }
+    return item;
+}
+
+QStringList EPubContainer::getItems()
+{
+    QStringList items;
+    items.reserve(m_spine.count());
+    for (const int index : m_spine) {
+        items.append(itemId(index).toString());
+    }
+    return items;
+}
+
+QStringList EPubContainer::getLinearItems()
+{
+    QStringList items;
+    items.reserve(m_spine.count());
+    for (const int index : m_spine) {
+        if (!m_manifest[index].unordered) {
+            items.append(itemId(index).toString());
+        }
+    }
+    return items;
+}
+
+QStringList EPubContainer::getManifestItems() const
+{
+    QStringList items;
+    items.reserve(m_manifest.count());
+    for (int i=0; i<m_manifest.count(); i++) {
+        items.append(itemId(i).toString());
+    }
+    return items;
+}
+
+bool EPubContainer::isAuxiliaryItem(const QString &id) const
+{
+    const int index = findItem(id);
+    return index != -1 && m_manifest[index].unordered;
+}
+
+QString EPubContainer::getItemId(const QString &path) const
+{
+    // The last one wins if there are duplicates, like when it was a hash
+    const QVector<int>::const_iterator it = std::upper_bound(m_pathIndex.constBegin(), m_pathIndex.constEnd(), path, [this](const QString &path, int index) {
+        return path < itemPath(index);
+    });
+    if (it == m_pathIndex.constBegin() || itemPath(*(it - 1)) != path) {
+        return QString();
+    }
+    return itemId(*(it - 1)).toString();
 }
 
 QImage EPubContainer::getImage(const QString &id)
 {
-    if (!m_items.contains(id)) {
+    const EpubItem item = getEpubItem(id);
+    if (item.path.isEmpty()) {
         qWarning() << "Asked for unknown item" << id;
         return QImage();
     }
 
-    const EpubItem &item = m_items.value(id);
-
     if (!QImageReader::supportedMimeTypes().contains(item.mimetype)) {
         qWarning() << "Asked for unsupported type" << item.mimetype;
         return QImage();
     }
 
-    QSharedPointer<QIODevice> ioDevice = getIoDevice(item.path);
-
-    if (!ioDevice) {
+    const QByteArray data = readFile(item.path, ImageConsumer);
+    if (data.isEmpty()) {
         return QImage();
     }
 
-    return QImage::fromData(ioDevice->readAll());
+    return QImage::fromData(data);
 }
 
 QString EPubContainer::getMetadata(const QString &key)
@@ -105,7 +321,10 @@ bool EPubContainer::parseMimetype()
         return false;
     }
 
-    QScopedPointer<QIODevice> ioDevice(mimetypeFile->createDevice());
+    QSharedPointer<QIODevice> ioDevice = openDevice(mimetypeFile, MIMETYPE_FILE, MetadataConsumer);
+    if (!ioDevice) {
+        return false;
+    }
     QByteArray mimetype = ioDevice->readAll();
     if (mimetype != "application/epub+zip") {
         qWarning() << "Unexpected mimetype" << mimetype;
@@ -125,8 +344,10 @@ bool EPubContainer::parseContainer()
         return false;
     }
 
-    QScopedPointer<QIODevice> ioDevice(containerFile->createDevice());
-    Q_ASSERT(ioDevice);
+    QSharedPointer<QIODevice> ioDevice = openDevice(containerFile, CONTAINER_FILE, MetadataConsumer);
+    if (!ioDevice) {
+        return false;
+    }
 
     // The only thing we need from this file is the path to the root file
     QDomDocument document;
@@ -163,7 +384,10 @@ bool EPubContainer::parseContentFile(const QString filepath)
         emit errorHappened(tr("Malformed metadata, unable to get content metadata path"));
         return false;
     }
-    QScopedPointer<QIODevice> ioDevice(rootFile->createDevice());
+    QSharedPointer<QIODevice> ioDevice = openDevice(rootFile, filepath, MetadataConsumer);
+    if (!ioDevice) {
+        return false;
+    }
     QDomDocument document;
     document.setContent(ioDevice.data(), true); // turn on namespace processing
 
@@ -192,6 +416,7 @@ bool EPubContainer::parseContentFile(const QString filepath)
             parseManifestItem(manifestItemList.at(j), contentFileFolder);
         }
     }
+    buildManifestIndexes();
 
     // Parse out the document order
     QDomNodeList spineNodeList = document.elementsByTagName("spine");
@@ -199,7 +424,7 @@ bool EPubContainer::parseContentFile(const QString filepath)
         QDomElement spineElement = spineNodeList.at(i).toElement();
 
         QString tocId = spineElement.attribute("toc");
-        if (!tocId.isEmpty() && m_items.keys().contains(tocId)) {
+        if (!tocId.isEmpty() && findItem(tocId) != -1) {
             EpubPageReference tocReference;
             tocReference.title = tr("Table of Contents");
             tocReference.target = tocId;
@@ -234,7 +459,11 @@ bool EPubContainer::parseMetadataItem(const QDomNode &metadataNode)
     QString metaName;
     QString metaValue;
 
-    if (tagName == "meta") {
+    if (tagName == "meta" && metadataElement.hasAttribute("property")) {
+        // EPUB 3 style, e. g. rendition:layout
+        metaName = metadataElement.attribute("property");
+        metaValue = metadataElement.text().trimmed();
+    } else if (tagName == "meta") {
         metaName = metadataElement.attribute("name");
         metaValue = metadataElement.attribute("content");
     } else if (metadataElement.prefix() != "dc") {
@@ -271,16 +500,18 @@ bool EPubContainer::parseManifestItem(const QDomNode &manifestNode, const QStrin
     // Resolve relative paths
     path = QDir::cleanPath(currentFolder + path);
 
-    EpubItem item;
-    item.mimetype  = type.toUtf8();
-    item.path = path;
-    m_items[id] = item;
+    ManifestItem item;
+    item.idOffset = addString(id);
+    item.idLength = id.length();
+    item.pathOffset = addString(path);
+    item.pathLength = path.length();
+    item.mimetype = mimetypeAtom(type);
 
     static QSet<QString> documentTypes({"text/x-oeb1-document", "application/x-dtbook+xml", "application/xhtml+xml"});
-    // All items not listed in the spine should be in this
-    if (documentTypes.contains(type)) {
-        m_unorderedItems.insert(id);
-    }
+    // Cleared for the ones listed in the spine
+    item.unordered = documentTypes.contains(type);
+
+    m_manifest.append(item);
 
     return true;
 }
@@ -289,28 +520,89 @@ bool EPubContainer::parseSpineItem(const QDomNode &spineNode)
 {
     QDomElement spineElement = spineNode.toElement();
 
-    // Ignore this for now
-    if (spineElement.attribute("linear") == "no") {
-//        return true;
-    }
-
     QString referenceName = spineElement.attribute("idref");
     if (referenceName.isEmpty()) {
         qWarning() << "Invalid spine item at line" << spineNode.lineNumber();
         return false;
     }
 
-    if (!m_items.keys().contains(referenceName)) {
+    const int index = findItem(referenceName);
+    if (index == -1) {
         qWarning() << "Unable to find" << referenceName << "in items";
         return false;
     }
 
-    m_unorderedItems.remove(referenceName);
-    m_orderedItems.append(referenceName);
+    // Not part of the reading order, only shown when something links to it
+    m_manifest[index].unordered = spineElement.attribute("linear") == "no";
+    m_spine.append(index);
 
     return true;
 }
 
+QStringRef EPubContainer::itemId(int index) const
+{
+    const ManifestItem &item = m_manifest[index];
+    return QStringRef(&m_strings, item.idOffset, item.idLength);
+}
+
+QStringRef EPubContainer::itemPath(int index) const
+{
+    const ManifestItem &item = m_manifest[index];
+    return QStringRef(&m_strings, item.pathOffset, item.pathLength);
+}
+
+int EPubContainer::findItem(const QString &id) const
+{
+    // The last one wins if there are duplicates, like when it was a hash
+    const QVector<int>::const_iterator it = std::upper_bound(m_idIndex.constBegin(), m_idIndex.constEnd(), id, [this](const QString &id, int index) {
+        return id < itemId(index);
+    });
+    if (it == m_idIndex.constBegin() || itemId(*(it - 1)) != id) {
+        return -1;
+    }
+    return *(it - 1);
+}
+
+int EPubContainer::addString(const QString &string)
+{
+    const int offset = m_strings.length();
+    m_strings.append(string);
+    return offset;
+}
+
+quint16 EPubContainer::mimetypeAtom(const QString &mimetype)
+{
+    // Books only use a handful of different ones
+    const QByteArray utf8 = mimetype.toUtf8();
+    const int index = m_mimetypes.indexOf(utf8);
+    if (index != -1) {
+        return index;
+    }
+
+    m_mimetypes.append(utf8);
+    return m_mimetypes.count() - 1;
+}
+
+void EPubContainer::buildManifestIndexes()
+{
+    m_strings.squeeze();
+    m_manifest.squeeze();
+
+    m_idIndex.resize(m_manifest.count());
+    for (int i=0; i<m_manifest.count(); i++) {
+        m_idIndex[i] = i;
+    }
+    m_pathIndex = m_idIndex;
+
+    // Stable, so the last of any duplicates is last
+    std::stable_sort(m_idIndex.begin(), m_idIndex.end(), [this](int a, int b) {
+        return itemId(a) < itemId(b);
+    });
+    std::stable_sort(m_pathIndex.begin(), m_pathIndex.end(), [this](int a, int b) {
+        return itemPath(a) < itemPath(b);
+    });
+}
+
 bool EPubContainer::parseGuideItem(const QDomNode &guideItem)
 {
     QDomElement guideElement = guideItem.toElement();
@@ -402,6 +694,211 @@ const KArchiveFile *EPubContainer::getFile(const QString &path)
     return file;
 }
 
+bool EPubContainer::checkArchiveSizes()
+{
+    m_blockedFiles.clear();
+
+    qint64 totalSize = 0;
+    QList<const KArchiveDirectory*> folders({m_rootFolder});
+    while (!folders.isEmpty()) {
+        const KArchiveDirectory *folder = folders.takeLast();
+        const QStringList entries = folder->entries();
+        for (const QString &name : entries) {
+            const KArchiveEntry *entry = folder->entry(name);
+            if (entry->isDirectory()) {
+                folders.append(static_cast<const KArchiveDirectory*>(entry));
+                continue;
+            }
+
+            const KZipFileEntry *file = dynamic_cast<const KZipFileEntry*>(entry);
+            if (!file) {
+                continue;
+            }
+            totalSize += file->size();
+
+            // Refuse to read single files that are obviously broken, the rest of the book might still be usable
+            if (file->size() > m_maximumFileSize) {
+                m_blockedFiles.insert(file);
+                emit errorHappened(tr("%1 is too large (%2 MB)").arg(name.left(100)).arg(file->size() / (1024 * 1024)));
+            } else if (file->size() > s_minimumSuspiciousSize && file->size() > file->compressedSize() * s_maximumCompressionRatio) {
+                m_blockedFiles.insert(file);
+                emit errorHappened(tr("%1 is suspiciously well compressed (%2 MB from %3 KB)").arg(name.left(100))
+                                   .arg(file->size() / (1024 * 1024)).arg(file->compressedSize() / 1024));
+            }
+        }
+    }
+
+    if (totalSize > m_maximumTotalSize) {
+        emit errorHappened(tr("The book is too large when uncompressed (%1 MB)").arg(totalSize / (1024 * 1024)));
+        return false;
+    }
+
+    return true;
+}
+
+QSharedPointer<QIODevice> EPubContainer::openDevice(const KArchiveFile *file, const QString &path, Consumer consumer)
+{
+    if (m_blockedFiles.contains(file)) {
+        emit errorHappened(tr("Refusing to read %1").arg(path.left(100)));
+        return QSharedPointer<QIODevice>();
+    }
+
+    QIODevice *device = file->createDevice();
+    if (!device) {
+        emit errorHappened(tr("Unable to read file %1").arg(path.left(100)));
+        return QSharedPointer<QIODevice>();
+    }
+
+    QSharedPointer<ResourceStatistics> statistics;
+    if (m_statisticsEnabled) {
+        statistics = m_statistics.value(path);
+        if (!statistics) {
+            statistics.reset(new ResourceStatistics);
+            statistics->size = file->size();
+            const KZipFileEntry *zipEntry = dynamic_cast<const KZipFileEntry*>(file);
+            statistics->compressedSize = zipEntry ? zipEntry->compressedSize() : file->size();
+            m_statistics.insert(path, statistics);
+        }
+        statistics->opens++;
+        statistics->consumers |= 1 << consumer;
+    }
+
+    QPointer<EPubContainer> container(this);
+    return QSharedPointer<QIODevice>(new GuardedDevice(device, file->size(), [container, path]() {
+        if (container) {
+            emit container->errorHappened(tr("%1 is larger than it claims to be, aborted reading it").arg(path.left(100)));
+        }
+    }, statistics));
+}
+
+QHash<QString, EPubContainer::ResourceStatistics> EPubContainer::resourceStatistics() const
+{
+    QHash<QString, ResourceStatistics> statistics;
+    for (QHash<QString, QSharedPointer<ResourceStatistics>>::const_iterator it = m_statistics.constBegin(); it != m_statistics.constEnd(); ++it) {
+        statistics.insert(it.key(), *it.value());
+    }
+    return statistics;
+}
+
+void EPubContainer::mergeStatistics(EPubContainer *other)
+{
+    for (QHash<QString, QSharedPointer<ResourceStatistics>>::const_iterator it = other->m_statistics.constBegin(); it != other->m_statistics.constEnd(); ++it) {
+        const ResourceStatistics &resource = *it.value();
+        QSharedPointer<ResourceStatistics> &statistics = m_statistics[it.key()];
+        if (!statistics) {
+            statistics.reset(new ResourceStatistics);
+        }
+        statistics->opens += resource.opens;
+        statistics->consumers |= resource.consumers;
+        statistics->compressedSize = resource.compressedSize;
+        statistics->size = resource.size;
+        statistics->bytesInflated += resource.bytesInflated;
+        statistics->inflateTime += resource.inflateTime;
+    }
+    other->m_statistics.clear();
+}
+
+QString EPubContainer::statisticsReport() const
+{
+    const QHash<QString, ResourceStatistics> statistics = resourceStatistics();
+
+    // Most expensive first
+    QStringList paths = statistics.keys();
+    std::sort(paths.begin(), paths.end(), [&](const QString &a, const QString &b) {
+        return statistics[a].inflateTime > statistics[b].inflateTime;
+    });
+
+    QString report = QStringLiteral("Archive statistics for %1\n").arg(m_archive ? m_archive->fileName() : QString());
+    report += QStringLiteral("%1 %2 %3 %4 %5  %6  %7\n")
+            .arg("ms", 9).arg("opens", 6).arg("inflated KB", 12).arg("size KB", 10).arg("packed KB", 10)
+            .arg("consumers", -24).arg("path");
+
+    qint64 totalTime = 0, totalInflated = 0;
+    for (const QString &path : paths) {
+        const ResourceStatistics &resource = statistics[path];
+        totalTime += resource.inflateTime;
+        totalInflated += resource.bytesInflated;
+
+        QStringList consumers;
+        for (int consumer = 0; consumer < ConsumerCount; consumer++) {
+            if (resource.consumers & (1 << consumer)) {
+                consumers.append(consumerName(Consumer(consumer)));
+            }
+        }
+
+        report += QStringLiteral("%1 %2 %3 %4 %5  %6  %7\n")
+                .arg(resource.inflateTime / 1000000., 9, 'f', 2)
+                .arg(resource.opens, 6)
+                .arg(resource.bytesInflated / 1024, 12)
+                .arg(resource.size / 1024, 10)
+                .arg(resource.compressedSize / 1024, 10)
+                .arg(consumers.join(','), -24)
+                .arg(path);
+    }
+    report += QStringLiteral("Total: %1 ms, %2 KB inflated from %3 files")
+            .arg(totalTime / 1000000., 0, 'f', 2).arg(totalInflated / 1024).arg(paths.count());
+
+    return report;
+}
+
+QString EPubContainer::consumerName(Consumer consumer)
+{
+    switch(consumer) {
+    case OtherConsumer:
+        return "other";
+    case MetadataConsumer:
+        return "metadata";
+    case ChapterConsumer:
+        return "chapter";
+    case StyleSheetConsumer:
+        return "stylesheet";
+    case FontConsumer:
+        return "font";
+    case ImageConsumer:
+        return "image";
+    case SvgConsumer:
+        return "svg";
+    default:
+        return "invalid";
+    }
+}
+
+EpubChunkReader::EpubChunkReader(const QSharedPointer<QIODevice> &device, int chunkSize) :
+    m_device(device),
+    m_chunkSize(qMax(1, chunkSize)),
+    m_bytesRead(0),
+    m_atEnd(false)
+{
+}
+
+bool EpubChunkReader::atEnd() const
+{
+    return m_atEnd || !m_device || m_device->atEnd();
+}
+
+const QByteArray &EpubChunkReader::readChunk()
+{
+    if (atEnd()) {
+        m_buffer.resize(0);
+        return m_buffer;
+    }
+
+    m_buffer.resize(m_chunkSize);
+    const qint64 bytesRead = m_device->read(m_buffer.data(), m_chunkSize);
+    if (bytesRead <= 0) {
+        if (bytesRead < 0) {
+            qWarning() << "Error while reading:" << m_device->errorString();
+        }
+        m_atEnd = true;
+        m_buffer.resize(0);
+        return m_buffer;
+    }
+
+    m_buffer.resize(int(bytesRead));
+    m_bytesRead += bytesRead;
+    return m_buffer;
+}
+
 EpubPageReference::StandardType EpubPageReference::typeFromString(const QString &name) {
     if (name == "cover") {
         return CoverPage;
@@ -7,10 +7,12 @@
 #include <QVector>
 #include <QDomNode>
 #include <QMimeDatabase>
+#include <QSharedPointer>
 
 class KZip;
 class KArchiveDirectory;
 class KArchiveFile;
+class KArchiveEntry;
 class QXmlStreamReader;
 
 struct EpubItem {
@@ -46,21 +48,108 @@ struct EpubPageReference {
     QString title;
 };
 
+// Reads a file from the archive in fixed size chunks, so callers that can
+// process the data incrementally never need to hold all of it in memory
+class EpubChunkReader
+{
+public:
+    enum { DefaultChunkSize = 64 * 1024 };
+
+    explicit EpubChunkReader(const QSharedPointer<QIODevice> &device = QSharedPointer<QIODevice>(), int chunkSize = DefaultChunkSize);
+
+    bool isValid() const { return !m_device.isNull(); }
+    bool atEnd() const;
+
+    // The returned buffer is reused, and is empty at the end or on errors
+    const QByteArray &readChunk();
+
+    qint64 bytesRead() const { return m_bytesRead; }
+
+private:
+    QSharedPointer<QIODevice> m_device;
+    QByteArray m_buffer;
+    int m_chunkSize;
+    qint64 m_bytesRead;
+    bool m_atEnd;
+};
+
 class EPubContainer : public QObject
 {
     Q_OBJECT
 public:
+    // What a file was read for, for the statistics
+    enum Consumer {
+        OtherConsumer,
+        MetadataConsumer,
+        ChapterConsumer,
+        StyleSheetConsumer,
+        FontConsumer,
+        ImageConsumer,
+        SvgConsumer,
+        ConsumerCount
+    };
+
+    struct ResourceStatistics {
+        int opens = 0;
+        int consumers = 0; // 1 << Consumer
+        qint64 compressedSize = 0;
+        qint64 size = 0;
+        qint64 bytesInflated = 0; // in total, over all the opens
+        qint64 inflateTime = 0; // nanoseconds
+    };
+
     explicit EPubContainer(QObject *parent);
     ~EPubContainer();
 
+    // Per file accounting of what is read, enabled by default if
+    // EPUBREADER_ARCHIVE_STATISTICS is set. The report is printed when
+    // the container is destroyed.
+    void setStatisticsEnabled(bool enabled) { m_statisticsEnabled = enabled; }
+    bool statisticsEnabled() const { return m_statisticsEnabled; }
+    QHash<QString, ResourceStatistics> resourceStatistics() const;
+    QString statisticsReport() const;
+
+    // Adds the statistics from another container for the same file, e. g.
+    // one used by a different thread, and clears them there so they are
+    // only reported once
+    void mergeStatistics(EPubContainer *other);
+    static QString consumerName(Consumer consumer);
+
+    // Guards against zip bombs and broken archives, checked against the
+    // sizes in the central directory when opening, and enforced while
+    // reading. Set before calling openFile().
+    static const qint64 DefaultMaximumFileSize = 256 * 1024 * 1024;
+    static const qint64 DefaultMaximumTotalSize = 2048LL * 1024 * 1024;
+    void setMaximumFileSize(qint64 bytes) { m_maximumFileSize = bytes; }
+    void setMaximumTotalSize(qint64 bytes) { m_maximumTotalSize = bytes; }
+
     bool openFile(const QString path);
 
-    EpubItem getEpubItem(const QString &id) const { return m_items.value(id); }
+    // The two halves of openFile(), for measuring them separately
+    bool openArchive(const QString &path);
+    bool parseContents();
 
-    QSharedPointer<QIODevice> getIoDevice(const QString &path);
+    EpubItem getEpubItem(const QString &id) const;
+
+    QSharedPointer<QIODevice> getIoDevice(const QString &path, Consumer consumer = OtherConsumer);
+    EpubChunkReader getChunkReader(const QString &path, Consumer consumer = OtherConsumer, int chunkSize = EpubChunkReader::DefaultChunkSize);
+    QByteArray readFile(const QString &path, Consumer consumer = OtherConsumer);
+
+    // Uncompressed, from the archive directory, so nothing is read. -1 if it doesn't exist.
+    qint64 getFileSize(const QString &path);
     QImage getImage(const QString &id);
     QString getMetadata(const QString &key);
-    QStringList getItems() { return m_orderedItems; }
+    // The whole spine, getLinearItems() skips the linear="no" ones
+    QStringList getItems();
+    QStringList getLinearItems();
+
+    // Everything in the manifest, also what isn't in the spine
+    QStringList getManifestItems() const;
+
+    // Documents outside the linear reading order, like linear="no" spine
+    // items and ones only reachable through links
+    bool isAuxiliaryItem(const QString &id) const;
+    QString getItemId(const QString &path) const;
 
     QString getStandardPage(EpubPageReference::StandardType type) { return m_standardReferences.value(type).target; }
 
@@ -70,6 +159,15 @@ signals:
 public slots:
 
 private:
+    struct ManifestItem {
+        int idOffset;
+        int idLength;
+        int pathOffset;
+        int pathLength;
+        quint16 mimetype; // in m_mimetypes
+        bool unordered; // a document that isn't in the linear reading order
+    };
+
     bool parseMimetype();
     bool parseContainer();
     bool parseContentFile(const QString filepath);
@@ -80,14 +178,36 @@ private:
 
     const KArchiveFile *getFile(const QString &path);
 
+    QStringRef itemId(int index) const;
+    QStringRef itemPath(int index) const;
+    int findItem(const QString &id) const;
+    int addString(const QString &string);
+    quint16 mimetypeAtom(const QString &mimetype);
+    void buildManifestIndexes();
+    bool checkArchiveSizes();
+    QSharedPointer<QIODevice> openDevice(const KArchiveFile *file, const QString &path, Consumer consumer);
+
     KZip *m_archive;
     const KArchiveDirectory *m_rootFolder;
 
+    qint64 m_maximumFileSize;
+    qint64 m_maximumTotalSize;
+    QSet<const KArchiveEntry*> m_blockedFiles;
+
+    bool m_statisticsEnabled;
+    QHash<QString, QSharedPointer<ResourceStatistics>> m_statistics; // shared with the open devices
+
     QHash<QString, QString> m_metadata;
 
-    QHash<QString, EpubItem> m_items;
-    QStringList m_orderedItems;
-    QSet<QString> m_unorderedItems;
+    // Manifests can have tens of thousands of items, so instead of a
+    // couple of small allocations per item all the ids and paths are
+    // stored in one string, and the items refer to them by offset
+    QString m_strings;
+    QVector<QByteArray> m_mimetypes;
+    QVector<ManifestItem> m_manifest;
+    QVector<int> m_idIndex; // into m_manifest, sorted by id
+    QVector<int> m_pathIndex; // sorted by path
+    QVector<int> m_spine; // with the linear="no" items
 
     QHash<EpubPageReference::StandardType, EpubPageReference> m_standardReferences;
     QHash<QString, EpubPageReference> m_otherReferences;
@@ -1,31 +1,189 @@
 #include "epubdocument.h"
 #include "epubcontainer.h"
+#include "epubsession.h"
+#include "chapterpreprocessor.h"
 #include <QIODevice>
 #include <QDebug>
 #include <QDir>
 #include <QTextCursor>
 #include <QThread>
 #include <QElapsedTimer>
-#include <QDomDocument>
 #include <QSvgRenderer>
 #include <QPainter>
 #include <QTextBlock>
 #include <QRegularExpression>
-#include <QFontDatabase>
 #include <QTextDocumentFragment>
 #include <QImageReader>
 #include <QAbstractTextDocumentLayout>
+#include <QGuiApplication>
+#include <QBuffer>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QFutureInterface>
+#include <QXmlStreamReader>
+#include <QScopedPointer>
+#include <QTimer>
 #include <qmath.h>
 
 #ifdef DEBUG_CSS
 #include <private/qcssparser_p.h>
 #endif
 
+namespace {
+// Layout uses the size from the width and height attributes, so the
+// placeholder only has to fill in until the real image is ready
+const QImage &placeholderImage()
+{
+    static const QImage placeholder = []() {
+        QImage image(1, 1, QImage::Format_ARGB32_Premultiplied);
+        image.fill(Qt::transparent);
+        return image;
+    }();
+    return placeholder;
+}
+
+// Like QtConcurrent::run(), but we get to set the priority when starting it
+class SvgRenderTask : public QRunnable
+{
+public:
+    SvgRenderTask(const QByteArray &svg, const QSize &size) :
+        m_svg(svg),
+        m_size(size)
+    {
+        m_result.reportStarted();
+    }
+
+    QFuture<QImage> future() { return m_result.future(); }
+
+    void run() override
+    {
+        if (!m_result.isCanceled()) {
+            m_result.reportResult(EPubDocument::renderSvg(m_svg, m_size));
+        }
+        m_result.reportFinished();
+    }
+
+private:
+    QByteArray m_svg;
+    QSize m_size;
+    QFutureInterface<QImage> m_result;
+};
+
+// Picks the text width from a few chapters laid out on their own, instead
+// of laying out the whole book several times. The rest of the chapters are
+// extrapolated from their file sizes, so they don't need to be read.
+class WidthEstimator
+{
+public:
+    explicit WidthEstimator(const QTextDocument *document) :
+        m_document(document),
+        m_sampledSize(0),
+        m_totalSize(0)
+    {
+    }
+
+    ~WidthEstimator()
+    {
+        qDeleteAll(m_samples);
+    }
+
+    QTextDocument *addSample(qint64 fileSize)
+    {
+        QTextDocument *sample = new QTextDocument;
+        sample->setUndoRedoEnabled(false);
+        sample->setDefaultFont(m_document->defaultFont());
+        sample->setDefaultStyleSheet(m_document->defaultStyleSheet());
+        sample->setDocumentMargin(m_document->documentMargin());
+        m_samples.append(sample);
+        m_sampledSize += fileSize;
+        return sample;
+    }
+
+    void addChapter(qint64 fileSize)
+    {
+        m_totalSize += fileSize;
+    }
+
+    bool isEmpty() const
+    {
+        return m_samples.isEmpty();
+    }
+
+    // What the size of the whole book would be at this width, without
+    // pages, like the whole book was measured before
+    QSizeF estimateSize(qreal width)
+    {
+        const qreal margin = m_document->documentMargin();
+
+        qreal sampledHeight = 0;
+        qreal maxWidth = 0;
+        for (QTextDocument *sample : m_samples) {
+            sample->setTextWidth(width);
+            const QSizeF size = sample->size();
+            sampledHeight += size.height() - margin * 2;
+            maxWidth = qMax(maxWidth, size.width());
+        }
+        if (m_sampledSize == 0) {
+            return QSizeF();
+        }
+
+        return QSizeF(maxWidth, sampledHeight * m_totalSize / m_sampledSize + margin * 2);
+    }
+
+    // At the width from the last estimateSize()
+    qreal idealWidth() const
+    {
+        qreal width = 0;
+        for (const QTextDocument *sample : m_samples) {
+            width = qMax(width, sample->idealWidth());
+        }
+        return width;
+    }
+
+private:
+    const QTextDocument *m_document;
+    QList<QTextDocument*> m_samples;
+    qint64 m_sampledSize;
+    qint64 m_totalSize;
+};
+
+// Anchors and links are looked up by this, so the percent encoding and
+// things like "./" are the same no matter how the book wrote them
+QString linkKey(const QUrl &url)
+{
+    return url.toString(QUrl::NormalizePathSegments);
+}
+
+// How many chapters the text width is estimated from
+const int s_widthSampleCount = 3;
+
+// How long to insert chapters before letting the event loop run, about a frame
+const int s_loadChunkTime = 16;
+
+// How many of the following SVGs to render when one becomes visible
+const int s_svgPrefetchCount = 4;
+
+// Old prefetches are dropped from the end of the queue when scrolling around
+const int s_maxQueuedSvgs = 32;
+
+// For SVGs without a size, when we don't have a page size either
+const QSize s_defaultSvgSize(300, 150);
+}
+
+Q_GLOBAL_STATIC(QThreadPool, s_svgRenderPool)
+
 EPubDocument::EPubDocument(QObject *parent) : QTextDocument(parent),
     m_container(nullptr),
-    m_loaded(false)
+    m_loaded(false),
+    m_pageLimit(0),
+    m_synchronousResources(false)
 {
     setUndoRedoEnabled(false);
+
+    m_chunkTimer.setSingleShot(true);
+    m_chunkTimer.setInterval(0);
+    connect(&m_chunkTimer, &QTimer::timeout, this, &EPubDocument::loadNextChunk);
+
     connect(documentLayout(), &QAbstractTextDocumentLayout::documentSizeChanged, this, [=](const QSizeF &newSize) {
             qDebug() << "doc size changed" << newSize;
             m_docSize = newSize;
@@ -34,34 +192,87 @@ EPubDocument::EPubDocument(QObject *parent) : QTextDocument(parent),
 
 EPubDocument::~EPubDocument()
 {
-    for (const int fontId : m_loadedFonts) {
-        QFontDatabase::removeApplicationFont(fontId);
+    // Don't bother rendering what hasn't started yet
+    for (QFutureWatcher<QImage> *watcher : m_renderingSvgs) {
+        watcher->future().cancel();
+    }
+
+    MemoryBudget::instance()->releaseAll(this);
+}
+
+void EPubDocument::clearCache()
+{
+    for (const QString &id : m_renderedSvgs.keys()) {
+        MemoryBudget::instance()->release(this, MemoryBudget::SvgRasters, id);
     }
+    m_renderedSvgs.clear();
+
+    // The decoded images are shared with the other documents showing the
+    // book, and larger ones are decoded when they are asked for, so they are
+    // left to the memory budget
+}
+
+void EPubDocument::setPageSize(const QSizeF &size)
+{
+    if (size == pageSize()) {
+        return;
+    }
+
+    QTextDocument::setPageSize(size);
+
+    // The SVGs were sized to fit on the old pages
+    updateSvgSizes();
 }
 
 void EPubDocument::openDocument(const QString &path)
 {
     m_documentPath = path;
-    loadDocument();
+    loadDocument(EPubSession::open(path));
+}
+
+void EPubDocument::openDocument(const QSharedPointer<EPubSession> &session)
+{
+    if (session) {
+        m_documentPath = session->path();
+    }
+    loadDocument(session);
 }
 
-void EPubDocument::loadDocument()
+void EPubDocument::loadDocument(const QSharedPointer<EPubSession> &session)
 {
     QElapsedTimer timer;
     timer.start();
-    m_container = new EPubContainer(this);
-    connect(m_container, &EPubContainer::errorHappened, this, [](QString error) {
-        qWarning().noquote() << error;
-    });
 
-    if (!m_container->openFile(m_documentPath)) {
+    // In case we are still loading something else
+    m_chunkTimer.stop();
+    m_pendingItems.clear();
+    m_widthItems.clear();
+    m_preprocessor.reset();
+
+    if (m_session) {
+        disconnect(m_session.data(), nullptr, this, nullptr);
+    }
+
+    // Reuses the parsed container and the decoded resources if the book is
+    // already open somewhere else
+    m_session = session;
+    if (!m_session) {
         return;
     }
+    m_container = m_session->container();
+    connect(m_session.data(), &EPubSession::imageDecoded, this, &EPubDocument::onImageDecoded);
+
+    m_chapterPositions.clear();
+    m_anchorPositions.clear();
+    m_backlinks.clear();
+    m_imagePositions.clear();
+    m_imageSizes.clear();
+    m_svgOrder.clear();
     qDebug() << "Opened in" << timer.restart() << "ms";
     //QTextCursor cursor(this);
     //cursor.movePosition(QTextCursor::End);
 
-    QStringList items = m_container->getItems();
+    QStringList items = m_container->getLinearItems();
 
     QString cover = m_container->getStandardPage(EpubPageReference::CoverPage);
     if (!cover.isEmpty()) {
@@ -69,204 +280,763 @@ void EPubDocument::loadDocument()
         qDebug() << cover;
     }
 
-    QDomDocument domDoc;
+    // Decided after the first chapters are shown, so the rest can be laid
+    // out as they are inserted instead of all over again at the end. We
+    // keep the page width if only the first pages are loaded.
+    if (m_pageLimit == 0) {
+        m_widthItems = items;
+    }
+
+    m_preprocessor.reset(new ChapterPreprocessor);
+    setupPreprocessor(m_preprocessor.data());
+
+    m_pendingItems = items;
+    m_loadTimer.start();
+
+    // Synchronously, so there is something to show right away
+    insertChapters();
+}
+
+void EPubDocument::loadNextChunk()
+{
+    updateTextWidth();
+    insertChapters();
+}
+
+void EPubDocument::updateTextWidth()
+{
+    if (m_widthItems.isEmpty()) {
+        return;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    // Not with setTextWidth(), that throws away the page height the images
+    // are sized from
+    setPageSize(QSizeF(estimateTextWidth(m_widthItems), pageSize().height()));
+    m_widthItems.clear();
+    qDebug() << "Text width estimated in" << timer.elapsed() << "ms";
+}
+
+void EPubDocument::insertChapters(const QString &untilPath)
+{
+    QElapsedTimer timer;
+    timer.start();
+
     QTextCursor textCursor(this);
     textCursor.beginEditBlock();
     textCursor.movePosition(QTextCursor::End);
 
+    // Inserted as we go, so we never hold an entire chapter in memory
+    bool pageLimitReached = false;
+    m_preprocessor->setSegmentHandler([&](const QString &html) {
+        textCursor.insertFragment(QTextDocumentFragment::fromHtml(html));
+
+        if (m_pageLimit > 0) {
+            // The layout only happens outside the edit block
+            textCursor.endEditBlock();
+            if (pageCount() > m_pageLimit) {
+                pageLimitReached = true;
+                m_preprocessor->stop();
+            }
+            textCursor.beginEditBlock();
+        }
+    });
+
     QTextBlockFormat pageBreak;
     pageBreak.setPageBreakPolicy(QTextFormat::PageBreak_AlwaysBefore);
-    //for (const QString &chapter : items) {
-    while(!items.isEmpty()) {
-        const QString &chapter = items.takeFirst();
-        m_currentItem = m_container->getEpubItem(chapter);
-        if (m_currentItem.path.isEmpty()) {
+
+    // At least one chapter, so we always get somewhere
+    while (!m_pendingItems.isEmpty()) {
+        const QString chapter = m_pendingItems.takeFirst();
+        const QString path = m_container->getEpubItem(chapter).path;
+        if (path.isEmpty()) {
             continue;
         }
 
-        QSharedPointer<QIODevice> ioDevice = m_container->getIoDevice(m_currentItem.path);
-        if (!ioDevice) {
+        EpubChunkReader reader = m_container->getChunkReader(path, EPubContainer::ChapterConsumer);
+        if (!reader.isValid()) {
             qWarning() << "Unable to get iodevice for chapter" << chapter;
             continue;
         }
 
-        domDoc.setContent(ioDevice.data());
-        setBaseUrl(QUrl(m_currentItem.path));
-        fixImages(domDoc);
-        textCursor.insertFragment(QTextDocumentFragment::fromHtml(domDoc.toString()));
+        const int chapterStart = textCursor.position();
+        m_chapterPositions.insert(path, chapterStart);
+
+        setBaseUrl(QUrl(path));
+        if (!m_preprocessor->process(reader, path)) {
+            qWarning().noquote() << "Problem while reading chapter:" << m_preprocessor->errorString();
+        }
         textCursor.insertBlock(pageBreak);
+
+        // While it's fresh, so we never need to scan the whole document
+        indexChapter(chapterStart, path);
+
+        if (pageLimitReached) {
+            qDebug() << "Stopped after" << m_pageLimit << "pages";
+            m_pendingItems.clear();
+            break;
+        }
+        if (!untilPath.isNull()) {
+            if (path == untilPath) {
+                break;
+            }
+            continue;
+        }
+        if (timer.elapsed() >= s_loadChunkTime) {
+            break;
+        }
     }
-    qDebug() << "Base url:" << baseUrl();
     setBaseUrl(QUrl());
 
+    // Only lays out what was inserted now
+    textCursor.endEditBlock();
+    m_loaded = true;
+
+    // Can't be evicted, but it's good to know how much the text itself takes
+    MemoryBudget::instance()->charge(this, MemoryBudget::ChapterDocuments, m_documentPath, characterCount() * qint64(sizeof(QChar)));
+
+    if (isLoading()) {
+        // Lets the event loop handle input and painting in between
+        m_chunkTimer.start();
+        return;
+    }
+
+    m_preprocessor.reset();
+    qDebug() << "Load done in" << m_loadTimer.elapsed() << "ms";
     emit loadCompleted();
-    qDebug() << "Load done in" << timer.restart() << "ms";
-    {
-        QElapsedTimer timer;
-        timer.start();
-        QFont f = defaultFont();
-        QFontMetrics fm(f);
-        int mw =  fm.horizontalAdvance(QLatin1Char('x')) * 80;
-        int w = mw;
-        setTextWidth(w);
-        qDebug() << "Text width set in" << timer.restart() << "ms";
-        QSizeF size = m_docSize;
-        if (size.width() != 0) {
-            w = qSqrt((uint)(5 * size.height() * size.width() / 3));
-            setTextWidth(qMin(w, mw));
+}
+
+qreal EPubDocument::estimateTextWidth(const QStringList &items)
+{
+    // Spread out over the book
+    WidthEstimator widthEstimator(this);
+    QSet<int> sampledChapters;
+    for (int i=0; i<s_widthSampleCount; i++) {
+        sampledChapters.insert(items.count() * (2 * i + 1) / (2 * s_widthSampleCount));
+    }
+
+    QHash<QString, QSize> svgSizes;
+    ChapterPreprocessor preprocessor;
+    setupSamplePreprocessor(&preprocessor, &svgSizes);
+    for (int i=0; i<items.count(); i++) {
+        const QString path = m_container->getEpubItem(items[i]).path;
+        const qint64 size = path.isEmpty() ? -1 : m_container->getFileSize(path);
+        if (size <= 0) {
+            continue;
+        }
+        widthEstimator.addChapter(size);
+
+        if (!sampledChapters.contains(i)) {
+            continue;
+        }
+
+        EpubChunkReader reader = m_container->getChunkReader(path, EPubContainer::ChapterConsumer);
+        if (!reader.isValid()) {
+            continue;
+        }
 
-            size = m_docSize;//documentLayout()->documentSize();
+        QTextCursor sampleCursor(widthEstimator.addSample(size));
+        preprocessor.setSegmentHandler([&](const QString &html) {
+            sampleCursor.insertFragment(QTextDocumentFragment::fromHtml(html));
+        });
+        if (!preprocessor.process(reader, path)) {
+            qWarning().noquote() << "Problem while reading chapter:" << preprocessor.errorString();
+        }
+    }
+
+    // Same decision as QTextDocument::adjustSize(), but on the samples
+    QFontMetrics fm(defaultFont());
+    const qreal mw = fm.horizontalAdvance(QLatin1Char('x')) * 80;
+    qreal w = mw;
+    if (!widthEstimator.isEmpty()) {
+        QSizeF size = widthEstimator.estimateSize(w);
+        if (size.width() != 0) {
+            w = qSqrt(5 * size.height() * size.width() / 3);
+            size = widthEstimator.estimateSize(qMin(w, mw));
             if (w*3 < 5*size.height()) {
-                w = qSqrt((uint)(2 * size.height() * size.width()));
-                setTextWidth(qMin(w, mw));
+                w = qSqrt(2 * size.height() * size.width());
+                widthEstimator.estimateSize(qMin(w, mw));
             }
         }
-        qDebug() << "Text width changed in" << timer.restart() << "ms";
-        w = idealWidth();
-        qDebug() << "Ideal width in" << timer.restart() << "ms";
-        setTextWidth(w);
-        qDebug() << "Final text width in" << timer.restart() << "ms";
+        w = widthEstimator.idealWidth();
     }
-    qDebug() << "Adjust size done in" << timer.elapsed() << "ms";
-    textCursor.endEditBlock();
 
-    m_loaded = true;
+    return w;
 }
 
-void EPubDocument::fixImages(QDomDocument &newDocument)
+void EPubDocument::setupPreprocessor(ChapterPreprocessor *preprocessor)
 {
-    // TODO: FIXME: replace this with not smushing all HTML together in one document
-    { // Fix relative URLs, images are lazily loaded so the base URL might not
-      // be correct when they are loaded
-        QDomNodeList imageNodes = newDocument.elementsByTagName("img");
-        for (int i=0; i<imageNodes.count(); i++) {
-            QDomElement image = imageNodes.at(i).toElement();
-            if (!image.hasAttribute("src")) {
-                continue;
-            }
-            QUrl href = QUrl(image.attribute("src"));
-            href = baseUrl().resolved(href);
-            image.setAttribute("src", href.toString());
-        }
+    preprocessor->setImageHandler([this](ChapterPreprocessor::Attributes &attributes) {
+        reserveImageSize(attributes);
+    });
+    preprocessor->setSvgHandler([this](const QByteArray &svg) {
+        return storeSvg(svg);
+    });
+    preprocessor->setResourceLoader([this](const QString &path) {
+        return m_container->readFile(path, EPubContainer::SvgConsumer);
+    });
+}
+
+void EPubDocument::setupSamplePreprocessor(ChapterPreprocessor *preprocessor, QHash<QString, QSize> *svgSizes)
+{
+    // The samples are thrown away again, so the sizes are only put in the
+    // attributes, nothing is stored in the session or charged
+    preprocessor->setImageHandler([=](ChapterPreprocessor::Attributes &attributes) {
+        reserveImageSize(attributes, svgSizes);
+    });
+    preprocessor->setSvgHandler([=](const QByteArray &svg) {
+        const QString id = "svgcache:sample" + QString::number(svgSizes->count());
+        svgSizes->insert(id, svgLayoutSize(svg));
+        return id;
+    });
+    preprocessor->setResourceLoader([this](const QString &path) {
+        return m_container->readFile(path, EPubContainer::SvgConsumer);
+    });
+}
+
+int EPubDocument::anchorPosition(const QString &href)
+{
+    const QUrl url(linkKey(QUrl(href)));
+    const int chapterPosition = itemPosition(url.path());
+    if (chapterPosition == -1 || !url.hasFragment()) {
+        return chapterPosition;
     }
 
-    { // QImage which QtSvg uses isn't able to read files from inside the archive, so embed image data inline
-        QDomNodeList imageNodes = newDocument.elementsByTagName("image"); // SVG images
-        for (int i=0; i<imageNodes.count(); i++) {
-            QDomElement image = imageNodes.at(i).toElement();
-            if (!image.hasAttribute("xlink:href")) {
-                continue;
-            }
-            QString path = image.attribute("xlink:href");
-            QByteArray fileData = loadResource(0, QUrl(path)).toByteArray();
-            QByteArray data = "data:image/jpeg;base64," +fileData.toBase64();
-            image.setAttribute("xlink:href", QString::fromLatin1(data));
+    const int position = m_anchorPositions.value(linkKey(url), -1);
+    if (position == -1) {
+        qWarning() << "Unable to find anchor" << href;
+        return chapterPosition;
+    }
+
+    return position;
+}
+
+QList<int> EPubDocument::backlinks(const QString &href) const
+{
+    return m_backlinks.value(linkKey(QUrl(href)));
+}
+
+int EPubDocument::itemPosition(const QString &path)
+{
+    if (m_chapterPositions.contains(path)) {
+        return m_chapterPositions.value(path);
+    }
+    if (!m_loaded) {
+        return -1;
+    }
+
+    // Not inserted yet, so we get there now instead of dropping the link.
+    // Auxiliary documents are appended after the spine, so for those we
+    // need all of it.
+    if (isLoading()) {
+        m_chunkTimer.stop();
+        updateTextWidth();
+        insertChapters(path);
+
+        if (m_chapterPositions.contains(path)) {
+            return m_chapterPositions.value(path);
         }
     }
 
-    static int svgCounter = 0;
+    const QString id = m_container->getItemId(path);
+    if (id.isEmpty() || !m_container->isAuxiliaryItem(id)) {
+        qWarning() << "Not a document in the book" << path;
+        return -1;
+    }
+
+    return appendAuxiliaryItem(path);
+}
+
+int EPubDocument::appendAuxiliaryItem(const QString &path)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    EpubChunkReader reader = m_container->getChunkReader(path, EPubContainer::ChapterConsumer);
+    if (!reader.isValid()) {
+        qWarning() << "Unable to get iodevice for" << path;
+        return -1;
+    }
 
-    // QTextDocument isn't fond of SVGs, so rip them out and store them separately, and give it <img> instead
-    QDomNodeList svgNodes = newDocument.elementsByTagName("svg");
-    for (int i=0; i<svgNodes.count(); i++) {
-        QDomElement svgNode = svgNodes.at(i).toElement();
+    ChapterPreprocessor preprocessor;
+    setupPreprocessor(&preprocessor);
 
-        // Serialize out the old SVG, store it
-        QDomDocument tempDocument;
-        tempDocument.appendChild(tempDocument.importNode(svgNode, true));
-        QString svgId = QString::number(++svgCounter);
-        m_svgs.insert(svgId, tempDocument.toByteArray());
+    // The document always ends with an empty block starting a new page
+    QTextCursor textCursor(this);
+    textCursor.beginEditBlock();
+    textCursor.movePosition(QTextCursor::End);
+    const int start = textCursor.position();
 
-        // Create <img> node pointing to our SVG image
-        QDomElement imageElement = newDocument.createElement("img");
-        imageElement.setAttribute("src", "svgcache:" + svgId);
+    preprocessor.setSegmentHandler([&](const QString &html) {
+        textCursor.insertFragment(QTextDocumentFragment::fromHtml(html));
+    });
 
-        // Replace <svg> node with our <img> node
-        QDomNode parent = svgNodes.at(i).parentNode();
-        parent.replaceChild(imageElement, svgNode);
+    setBaseUrl(QUrl(path));
+    if (!preprocessor.process(reader, path)) {
+        qWarning().noquote() << "Problem while reading" << path << preprocessor.errorString();
     }
+    setBaseUrl(QUrl());
+
+    QTextBlockFormat pageBreak;
+    pageBreak.setPageBreakPolicy(QTextFormat::PageBreak_AlwaysBefore);
+    textCursor.insertBlock(pageBreak);
+    textCursor.endEditBlock();
+
+    m_chapterPositions.insert(path, start);
+    indexChapter(start, path);
+    MemoryBudget::instance()->charge(this, MemoryBudget::ChapterDocuments, m_documentPath, characterCount() * qint64(sizeof(QChar)));
+
+    qDebug() << "Loaded" << path << "in" << timer.elapsed() << "ms";
+    return start;
 }
 
-const QImage &EPubDocument::getSvgImage(const QString &id)
+QString EPubDocument::storeSvg(const QByteArray &svg)
+{
+    return "svgcache:" + m_session->storeSvg(svg);
+}
+
+QImage EPubDocument::getSvgImage(const QString &id)
 {
     if (m_renderedSvgs.contains(id)) {
-        return m_renderedSvgs[id];
+        MemoryBudget::instance()->touch(this, MemoryBudget::SvgRasters, id);
+        return m_renderedSvgs.value(id);
     }
-    if (!m_svgs.contains(id)) {
+    const QByteArray svg = m_session->svgData(id);
+    if (svg.isEmpty()) {
         qWarning() << "Couldn't find SVG" << id;
-        static QImage nullImg;
-        return nullImg;
+        return QImage();
     }
 
-    QSize imageSize(pageSize().width() - documentMargin() * 4,
-                    pageSize().height() - documentMargin() * 4);
+    if (m_synchronousResources) {
+        const QSize size = m_imageSizes.value("svgcache:" + id) * qGuiApp->devicePixelRatio();
+        const QImage image = size.isEmpty() ? QImage() : renderSvg(svg, size);
+        storeRenderedSvg(id, image);
+        return image;
+    }
 
+    // We only get asked for the ones that are painted
+    requestSvg(id, true);
 
-    QSvgRenderer renderer(m_svgs.value(id));
-    QSize svgSize(renderer.viewBox().size());
+    return placeholderImage();
+}
 
-    if (svgSize.isValid()) {
-        if (svgSize.scaled(imageSize, Qt::KeepAspectRatio).isValid()) {
-            svgSize.scale(imageSize, Qt::KeepAspectRatio);
-        }
-    } else {
-        svgSize = imageSize;
+QThreadPool *EPubDocument::svgRenderPool()
+{
+    return s_svgRenderPool();
+}
+
+QImage EPubDocument::renderSvg(const QByteArray &svg, const QSize &size)
+{
+    QSvgRenderer renderer(svg);
+    if (!renderer.isValid()) {
+        return QImage();
     }
 
-    QImage rendered(svgSize, QImage::Format_ARGB32);
+    // Premultiplied is what the raster engine blends with, so it can be drawn without converting
+    QImage rendered(size, QImage::Format_ARGB32_Premultiplied);
+    rendered.fill(Qt::transparent);
     QPainter painter(&rendered);
     if (!painter.isActive()) {
-        qWarning() << "Unable to activate painter" << svgSize;
-        static const QImage dummy = QImage();
-        return dummy;
+        qWarning() << "Unable to activate painter" << size;
+        return QImage();
     }
     renderer.render(&painter);
     painter.end();
 
-    m_renderedSvgs.insert(id, rendered);
-    return m_renderedSvgs[id];
+    return rendered;
 }
 
-QVariant EPubDocument::loadResource(int type, const QUrl &url)
+void EPubDocument::requestSvg(const QString &id, bool visible)
 {
-    Q_UNUSED(type);
+    if (m_renderedSvgs.contains(id) || m_renderingSvgs.contains(id)) {
+        return;
+    }
 
+    if (visible) {
+        m_queuedSvgs.removeOne(id);
+        m_queuedSvgs.prepend(id);
+        m_visibleSvgs.insert(id);
 
-    if (url.scheme() == "svgcache") {
-        return getSvgImage(url.path());
+        // Have the next ones ready when the user gets there
+        const int index = m_svgOrder.indexOf(id);
+        for (int i=index + 1; index != -1 && i<m_svgOrder.count() && i<=index + s_svgPrefetchCount; i++) {
+            requestSvg(m_svgOrder[i], false);
+        }
+    } else if (!m_queuedSvgs.contains(id)) {
+        m_queuedSvgs.append(id);
     }
 
-    if (url.scheme() == "data") {
-        QByteArray data = url.path().toUtf8();
-        const int start = data.indexOf(';');
-        if (start == -1) {
-            qWarning() << "unable to decode data:, no ;" << data.left(100);
-            data = QByteArray();
+    while (m_queuedSvgs.count() > s_maxQueuedSvgs) {
+        m_visibleSvgs.remove(m_queuedSvgs.takeLast());
+    }
+
+    startSvgRenders();
+}
+
+void EPubDocument::startSvgRenders()
+{
+    QThreadPool *pool = svgRenderPool();
+
+    while (!m_queuedSvgs.isEmpty() && m_renderingSvgs.count() < pool->maxThreadCount()) {
+        const QString id = m_queuedSvgs.takeFirst();
+        const bool visible = m_visibleSvgs.remove(id);
+
+        const QSize size = m_imageSizes.value("svgcache:" + id) * qGuiApp->devicePixelRatio();
+        const QByteArray svg = m_session->svgData(id);
+        if (svg.isEmpty() || size.isEmpty()) {
+            continue;
+        }
+
+        SvgRenderTask *task = new SvgRenderTask(svg, size);
+        QFutureWatcher<QImage> *watcher = new QFutureWatcher<QImage>(this);
+        connect(watcher, &QFutureWatcher<QImage>::finished, this, [=]() {
+            const QFuture<QImage> future = watcher->future();
+            m_renderingSvgs.remove(id);
+            watcher->deleteLater();
+
+            onSvgRendered(id, future.resultCount() > 0 ? future.result() : QImage());
+            startSvgRenders();
+        });
+        watcher->setFuture(task->future());
+        m_renderingSvgs.insert(id, watcher);
+
+        // What's on screen goes before prefetching, also for other documents
+        pool->start(task, visible ? 1 : 0);
+    }
+}
+
+void EPubDocument::onSvgRendered(const QString &id, const QImage &image)
+{
+    // Started before the page size changed, painting asks for a new one
+    const QSize size = m_imageSizes.value("svgcache:" + id) * qGuiApp->devicePixelRatio();
+    const bool outdated = !image.isNull() && image.size() != size;
+    if (!outdated && !storeRenderedSvg(id, image)) {
+        return;
+    }
+
+    for (const int position : m_imagePositions.value("svgcache:" + id)) {
+        markContentsDirty(position, 1);
+    }
+}
+
+bool EPubDocument::storeRenderedSvg(const QString &id, const QImage &image)
+{
+    // Failed ones are kept as null images, so we don't try again
+    m_renderedSvgs.insert(id, image);
+
+    if (image.isNull()) {
+        qWarning() << "Unable to render SVG" << id;
+        return false;
+    }
+
+    MemoryBudget::instance()->charge(this, MemoryBudget::SvgRasters, id, image.sizeInBytes(), [this](const QString &key) {
+        m_renderedSvgs.remove(key);
+    });
+    return true;
+}
+
+void EPubDocument::reserveSvgSize(const QUrl &url, ChapterPreprocessor::Attributes &attributes)
+{
+    // They are rendered in the background, so the layout needs the size up front
+    const QSize size = svgLayoutSize(m_session->svgData(url.path()));
+
+    m_imageSizes.insert(url.toString(), size);
+    m_svgOrder.append(url.path());
+
+    attributes.append(qMakePair(QString("width"), QString::number(size.width())));
+    attributes.append(qMakePair(QString("height"), QString::number(size.height())));
+}
+
+QSize EPubDocument::pageContentSize() const
+{
+    return QSize(pageSize().width() - documentMargin() * 4,
+                 pageSize().height() - documentMargin() * 4);
+}
+
+QSize EPubDocument::svgLayoutSize(const QByteArray &svg) const
+{
+    const QSize pageContentSize = this->pageContentSize();
+
+    QSize size = svgIntrinsicSize(svg);
+    if (!size.isValid()) {
+        size = pageContentSize;
+    } else if (pageContentSize.isValid()) {
+        size.scale(pageContentSize, Qt::KeepAspectRatio);
+    }
+
+    // Neither, do the same as browsers
+    if (!size.isValid()) {
+        size = s_defaultSvgSize;
+    }
+
+    return size;
+}
+
+void EPubDocument::updateSvgSizes()
+{
+    QTextCursor cursor(this);
+    cursor.beginEditBlock();
+
+    for (QHash<QString, QList<int>>::const_iterator it = m_imagePositions.constBegin(); it != m_imagePositions.constEnd(); ++it) {
+        if (!it.key().startsWith("svgcache:")) {
+            continue;
+        }
+
+        const QString id = QUrl(it.key()).path();
+        const QSize size = svgLayoutSize(m_session->svgData(id));
+        if (size == m_imageSizes.value(it.key())) {
+            continue;
+        }
+        m_imageSizes.insert(it.key(), size);
+
+        if (m_renderedSvgs.remove(id)) {
+            MemoryBudget::instance()->release(this, MemoryBudget::SvgRasters, id);
+        }
 
-            addResource(type, url, data);
-            return data;
+        for (const int position : it.value()) {
+            cursor.setPosition(position);
+            cursor.movePosition(QTextCursor::NextCharacter, QTextCursor::KeepAnchor);
+
+            QTextImageFormat format = cursor.charFormat().toImageFormat();
+            format.setWidth(size.width());
+            format.setHeight(size.height());
+            cursor.setCharFormat(format);
         }
+    }
+
+    cursor.endEditBlock();
+}
+
+QSize EPubDocument::svgIntrinsicSize(const QByteArray &svg)
+{
+    // Only reads the root element, parsing everything is what QSvgRenderer is for
+    QXmlStreamReader xml(svg);
+    xml.setNamespaceProcessing(false);
+    while (!xml.atEnd() && xml.readNext() != QXmlStreamReader::StartElement) {
+    }
+    if (!xml.isStartElement()) {
+        return QSize();
+    }
+    const QXmlStreamAttributes attributes = xml.attributes();
+
+    // Same as QSvgRenderer, prefer the view box
+    const QStringList viewBox = attributes.value("viewBox").toString().replace(',', ' ').split(' ', Qt::SkipEmptyParts);
+    if (viewBox.count() == 4) {
+        const QSizeF size(viewBox[2].toDouble(), viewBox[3].toDouble());
+        if (!size.isEmpty()) {
+            return size.toSize();
+        }
+    }
+
+    bool hasWidth = false, hasHeight = false;
+    const qreal width = attributes.value("width").toString().remove("px").toDouble(&hasWidth);
+    const qreal height = attributes.value("height").toString().remove("px").toDouble(&hasHeight);
+    if (hasWidth && hasHeight && width > 0 && height > 0) {
+        return QSizeF(width, height).toSize();
+    }
+
+    return QSize();
+}
+
+QImage EPubDocument::getImage(const QUrl &url)
+{
+    const QString key = url.toString();
+    if (m_synchronousResources) {
+        return m_session->decodeImageNow(url, targetImageSize(key));
+    }
+
+    const QImage image = m_session->image(url, targetImageSize(key));
+    if (!image.isNull() || !m_session->isImagePending(key)) {
+        return image;
+    }
+
+    return placeholderImage();
+}
+
+QSize EPubDocument::targetImageSize(const QString &key) const
+{
+    // No point in decoding more than what fits on a page on this screen
+    QSize size = pageContentSize();
+
+    const QSize displaySize = m_imageSizes.value(key);
+    if (displaySize.isValid()) {
+        size = size.isValid() ? size.boundedTo(displaySize) : displaySize;
+    }
+    size *= qGuiApp->devicePixelRatio();
+
+    const QSize nativeSize = m_session->nativeImageSize(key);
+    if (nativeSize.isValid()) {
+        size = size.isValid() ? nativeSize.scaled(size.boundedTo(nativeSize), Qt::KeepAspectRatio) : nativeSize;
+    }
+
+    return size;
+}
+
+void EPubDocument::reserveImageSize(ChapterPreprocessor::Attributes &attributes, const QHash<QString, QSize> *sampleSvgSizes)
+{
+    QUrl url;
+    QString widthValue, heightValue;
+    int widthIndex = -1, heightIndex = -1;
+    for (int i=0; i<attributes.count(); i++) {
+        if (attributes[i].first == "src") {
+            url = QUrl(attributes[i].second);
+        } else if (attributes[i].first == "width") {
+            widthIndex = i;
+            widthValue = attributes[i].second;
+        } else if (attributes[i].first == "height") {
+            heightIndex = i;
+            heightValue = attributes[i].second;
+        }
+    }
+    if (url.isEmpty()) {
+        return;
+    }
+    if (url.scheme() == "svgcache") {
+        if (sampleSvgSizes) {
+            const QSize size = sampleSvgSizes->value(url.toString());
+            attributes.append(qMakePair(QString("width"), QString::number(size.width())));
+            attributes.append(qMakePair(QString("height"), QString::number(size.height())));
+        } else {
+            reserveSvgSize(url, attributes);
+        }
+        return;
+    }
+
+    // Images are decoded asynchronously, so we need to tell the layout how
+    // big they are up front, only the image header is read for this
+    bool hasWidth = false, hasHeight = false;
+    const int width = widthValue.toInt(&hasWidth);
+    const int height = heightValue.toInt(&hasHeight);
+
+    // Don't mess with percentages and other units
+    if ((widthIndex != -1 && !hasWidth) || (heightIndex != -1 && !hasHeight)) {
+        return;
+    }
 
-        data = data.mid(start + 1);
-        if (data.startsWith("base64,")) {
-            data = QByteArray::fromBase64(data.mid(data.indexOf(',') + 1));
+    QSize size(width, height);
+    if (!hasWidth || !hasHeight) {
+        if (url.scheme() == "data") {
+            QByteArray data = EPubSession::decodeDataUrl(url);
+            QBuffer buffer(&data);
+            buffer.open(QIODevice::ReadOnly);
+            size = QImageReader(&buffer).size();
         } else {
-            qWarning() << "unable to decode data:, unknown encoding" << data.left(100);
-            data = QByteArray();
+            QSharedPointer<QIODevice> ioDevice = m_container->getIoDevice(url.path(), EPubContainer::ImageConsumer);
+            if (ioDevice) {
+                size = QImageReader(ioDevice.data()).size();
+            }
+        }
+
+        if (!size.isValid()) {
+            qWarning() << "Unable to read image size for" << url.toString().left(100);
+            return;
         }
+        if (!sampleSvgSizes) {
+            m_session->setNativeImageSize(url.toString(), size);
+        }
+
+        if (hasWidth) {
+            size = QSize(width, qRound(qreal(width) * size.height() / size.width()));
+        } else if (hasHeight) {
+            size = QSize(qRound(qreal(height) * size.width() / size.height()), height);
+        }
+    }
+
+    // Shrink huge images to fit on a page, so we don't need to keep them
+    // decoded at full resolution either
+    const QSize pageContentSize = this->pageContentSize();
+    if (pageContentSize.isValid() && (size.width() > pageContentSize.width() || size.height() > pageContentSize.height())) {
+        size.scale(pageContentSize, Qt::KeepAspectRatio);
+    }
+
+    // Can be shown at different sizes, the layout takes each one from the
+    // attributes, but it is only decoded once, for the biggest
+    if (!sampleSvgSizes) {
+        const QString key = url.toString();
+        m_imageSizes.insert(key, m_imageSizes.value(key).expandedTo(size));
+    }
+
+    if (widthIndex == -1) {
+        attributes.append(qMakePair(QString("width"), QString()));
+        widthIndex = attributes.count() - 1;
+    }
+    if (heightIndex == -1) {
+        attributes.append(qMakePair(QString("height"), QString()));
+        heightIndex = attributes.count() - 1;
+    }
+    attributes[widthIndex].second = QString::number(size.width());
+    attributes[heightIndex].second = QString::number(size.height());
+}
+
+void EPubDocument::onImageDecoded(const QString &key)
+{
+    // Only relayouts the blocks with the image, which makes the layout emit
+    // update() for just those areas
+    for (const int position : m_imagePositions.value(key)) {
+        markContentsDirty(position, 1);
+    }
+}
 
+void EPubDocument::indexChapter(int from, const QString &path)
+{
+    QString previousHref;
+    for (QTextBlock block = findBlock(from); block.isValid(); block = block.next()) {
+        for (QTextBlock::iterator it = block.begin(); !it.atEnd(); ++it) {
+            const QTextFragment fragment = it.fragment();
+            const QTextCharFormat format = fragment.charFormat();
+
+            if (format.isImageFormat()) {
+                // Each image is one character, but identical ones can be merged into one fragment
+                const QString key = QUrl(format.toImageFormat().name()).toString();
+                for (int i=0; i<fragment.length(); i++) {
+                    m_imagePositions[key].append(fragment.position() + i);
+                }
+            }
+
+            // Both from <a name> and id attributes
+            for (const QString &name : format.anchorNames()) {
+                const QString key = linkKey(QUrl(path + '#' + name));
+                if (!m_anchorPositions.contains(key)) {
+                    m_anchorPositions.insert(key, fragment.position());
+                }
+            }
+
+            // A link with different formatting inside is split into several fragments
+            const QString href = format.isAnchor() ? format.anchorHref() : QString();
+            if (!href.isEmpty() && href != previousHref) {
+                m_backlinks[linkKey(QUrl(href))].append(fragment.position());
+            }
+            previousHref = href;
+        }
+    }
+}
+
+QVariant EPubDocument::loadResource(int type, const QUrl &url)
+{
+    if (url.scheme() == "svgcache") {
+        return getSvgImage(url.path());
+    }
+
+    if (type == QTextDocument::ImageResource) {
+        return getImage(url);
+    }
+
+    if (url.scheme() == "data") {
+        const QByteArray data = EPubSession::decodeDataUrl(url);
         addResource(type, url, data);
         return data;
     }
 
 
-    QSharedPointer<QIODevice> ioDevice = m_container->getIoDevice(url.path());
-    if (!ioDevice) {
+    const EPubContainer::Consumer consumer = type == QTextDocument::StyleSheetResource ? EPubContainer::StyleSheetConsumer : EPubContainer::OtherConsumer;
+    QByteArray data = m_container->readFile(url.path(), consumer);
+    if (data.isNull()) {
         qWarning() << "Unable to get io device for" << url.toString().left(100);
         qDebug() << url.scheme();
         return QVariant();
     }
-    QByteArray data = ioDevice->readAll();
 
     if (type == QTextDocument::StyleSheetResource) {
         const QString cssData = QString::fromUtf8(data);
@@ -282,11 +1052,7 @@ QVariant EPubDocument::loadResource(int type, const QUrl &url)
             // Resolve relative and whatnot shit
             fontPath = QDir::cleanPath(QFileInfo(baseUrl().path()).path() + '/' + fontPath);
 
-            QSharedPointer<QIODevice> ioDevice = m_container->getIoDevice(fontPath);
-            if (ioDevice) {
-                m_loadedFonts.append(QFontDatabase::addApplicationFontFromData(ioDevice->readAll()));
-                qDebug() << "Loaded font" << QFontDatabase::applicationFontFamilies(m_loadedFonts.last());
-            } else {
+            if (!m_session->loadFont(fontPath)) {
                 qWarning() << "Failed to load font from" << fontPath << baseUrl();
             }
         }
@@ -2,12 +2,20 @@
 #define EPUBDOCUMENT_H
 
 #include "epubcontainer.h"
+#include "memorybudget.h"
+#include "chapterpreprocessor.h"
 #include <QObject>
 #include <QTextDocument>
 #include <QImage>
+#include <QSharedPointer>
+#include <QFutureWatcher>
+#include <QElapsedTimer>
+#include <QTimer>
 
 
 class EPubContainer;
+class EPubSession;
+class QThreadPool;
 
 class EPubDocument : public QTextDocument
 {
@@ -17,10 +25,47 @@ public:
     explicit EPubDocument(QObject *parent);
     virtual ~EPubDocument();
 
+    // The book is inserted a few chapters at a time, with the event loop
+    // running in between. loaded() is true as soon as the first ones are
+    // in, loadCompleted() is emitted when all of them are.
     bool loaded() { return m_loaded; }
+    bool isLoading() const { return !m_pendingItems.isEmpty() || !m_widthItems.isEmpty(); }
 
     void openDocument(const QString &path);
-    void clearCache() { m_renderedSvgs.clear(); }
+    // For when the book is already open, e. g. to see what kind it is
+    void openDocument(const QSharedPointer<EPubSession> &session);
+    void clearCache();
+
+    // Hides the one in QTextDocument, the SVGs are sized from it
+    void setPageSize(const QSizeF &size);
+
+    // Stops loading when there are more than this many pages, at the
+    // current page width. 0 loads the whole book.
+    void setPageLimit(int pages) { m_pageLimit = pages; }
+
+    // Decodes and renders images when they are painted, instead of in the
+    // background, for when nobody is around to repaint
+    void setSynchronousResources(bool synchronous) { m_synchronousResources = synchronous; }
+
+    // Where the file at path starts, auxiliary documents (e. g. footnotes
+    // or answer keys) are appended the first time they are asked for.
+    // While loading, the book is first inserted up to path.
+    // Returns -1 if it isn't a document in the book.
+    int itemPosition(const QString &path);
+
+    // Where a link like "OEBPS/chapter12.xhtml#fn3" goes, falls back to the
+    // start of the file if the fragment isn't found
+    int anchorPosition(const QString &href);
+
+    // Positions of the links going to href
+    QList<int> backlinks(const QString &href) const;
+
+    // SVGs are rendered here, separate from the pool used for other images
+    static QThreadPool *svgRenderPool();
+    static QImage renderSvg(const QByteArray &svg, const QSize &size);
+
+    // From the root element, without parsing the whole thing
+    static QSize svgIntrinsicSize(const QByteArray &svg);
 
 signals:
     void loadCompleted();
@@ -29,22 +74,64 @@ protected:
     virtual QVariant loadResource(int type, const QUrl &url) override;
 
 private slots:
-    void loadDocument();
+    void loadDocument(const QSharedPointer<EPubSession> &session);
+    void loadNextChunk();
 
 private:
-    void fixImages(QDomDocument &newDocument);
-    const QImage &getSvgImage(const QString &id);
+    void updateTextWidth();
+
+    // Inserts until untilPath is in, or everything if it isn't in the
+    // spine, otherwise for one chunk
+    void insertChapters(const QString &untilPath = QString());
+    qreal estimateTextWidth(const QStringList &items);
+    void setupPreprocessor(ChapterPreprocessor *preprocessor);
+    void setupSamplePreprocessor(ChapterPreprocessor *preprocessor, QHash<QString, QSize> *svgSizes);
+    int appendAuxiliaryItem(const QString &path);
+    QString storeSvg(const QByteArray &svg);
+    QImage getSvgImage(const QString &id);
+    void requestSvg(const QString &id, bool visible);
+    void startSvgRenders();
+    void onSvgRendered(const QString &id, const QImage &image);
+    bool storeRenderedSvg(const QString &id, const QImage &image);
+    void reserveSvgSize(const QUrl &url, ChapterPreprocessor::Attributes &attributes);
 
-    QHash<QString, QByteArray> m_svgs;
-    QHash<QString, QImage> m_renderedSvgs;
+    // What images and SVGs are fitted into
+    QSize pageContentSize() const;
+    QSize svgLayoutSize(const QByteArray &svg) const;
+    void updateSvgSizes();
+    QImage getImage(const QUrl &url);
+    QSize targetImageSize(const QString &key) const;
+    // Without sampleSvgSizes the sizes are also stored, for decoding and
+    // rendering, with them only the attributes are set
+    void reserveImageSize(ChapterPreprocessor::Attributes &attributes, const QHash<QString, QSize> *sampleSvgSizes = nullptr);
+    void onImageDecoded(const QString &key);
+    void indexChapter(int from, const QString &path);
+
+    QHash<QString, QImage> m_renderedSvgs; // depends on our page size
+    QHash<QString, QFutureWatcher<QImage>*> m_renderingSvgs;
+    QStringList m_queuedSvgs; // visible ones first
+    QSet<QString> m_visibleSvgs;
+    QStringList m_svgOrder; // in the document, for prefetching
+    QHash<QString, QSize> m_imageSizes; // in the layout
+    QHash<QString, QList<int>> m_imagePositions;
+    QHash<QString, int> m_chapterPositions; // by path
+    QHash<QString, int> m_anchorPositions; // by path#id
+    QHash<QString, QList<int>> m_backlinks; // by the normalized href
 
     QString m_documentPath;
+    QSharedPointer<EPubSession> m_session;
     EPubContainer *m_container;
-    EpubItem m_currentItem;
-    QList<int> m_loadedFonts;
+
+    QStringList m_pendingItems; // not inserted yet
+    QStringList m_widthItems; // the text width is estimated from, after the first chunk
+    QScopedPointer<ChapterPreprocessor> m_preprocessor;
+    QTimer m_chunkTimer;
+    QElapsedTimer m_loadTimer;
 
     QSizeF m_docSize;
     bool m_loaded;
+    int m_pageLimit;
+    bool m_synchronousResources;
 };
 
 #endif // EPUBDOCUMENT_H
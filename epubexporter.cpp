@@ -0,0 +1,246 @@
+#include "epubexporter.h"
+
+#include "epubcontainer.h"
+#include "chapterpreprocessor.h"
+
+#include <QCryptographicHash>
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QMimeDatabase>
+#include <QMutex>
+#include <QRegularExpression>
+#include <QThread>
+#include <QThreadPool>
+#include <QVector>
+#include <QtConcurrent>
+
+double EPubExporter::Statistics::megabytesPerSecond() const
+{
+    if (elapsedMs <= 0) {
+        return 0;
+    }
+    return inputBytes / (1024. * 1024.) / (elapsedMs / 1000.);
+}
+
+EPubExporter::EPubExporter(const QString &outputFolder, Format format) :
+    m_outputFolder(outputFolder),
+    m_format(format),
+    m_threadCount(QThread::idealThreadCount())
+{
+}
+
+bool EPubExporter::exportFile(const QString &path)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    EPubContainer container(nullptr);
+    QObject::connect(&container, &EPubContainer::errorHappened, [](const QString &error) {
+        qWarning().noquote() << error;
+    });
+    if (!container.openFile(path)) {
+        qWarning() << "Failed to open" << path;
+        return false;
+    }
+
+    const QString bookFolder = outputFolderName(path);
+    QDir outputDir(m_outputFolder);
+    if (!outputDir.mkpath(bookFolder) || !outputDir.cd(bookFolder)) {
+        qWarning() << "Unable to create output folder" << outputDir.filePath(bookFolder);
+        return false;
+    }
+
+    static const QRegularExpression unsafeCharacters("[^A-Za-z0-9_.-]");
+    const QString suffix = m_format == Html ? ".html" : ".txt";
+
+    QVector<Chapter> chapters;
+    QHash<QString, QString> outputNames; // by the chapter path, for the links
+    const QStringList items = container.getItems();
+    for (int i=0; i<items.count(); i++) {
+        const EpubItem item = container.getEpubItem(items[i]);
+        if (item.path.isEmpty()) {
+            continue;
+        }
+
+        Chapter chapter;
+        chapter.index = i;
+        chapter.path = item.path;
+        QString id = items[i];
+        const QString outputName = QString("%1-%2%3").arg(i, 4, 10, QLatin1Char('0')).arg(id.replace(unsafeCharacters, "_")).arg(suffix);
+        chapter.outputPath = outputDir.filePath(outputName);
+        chapters.append(chapter);
+        outputNames.insert(item.path, outputName);
+    }
+
+    // Every thread picks the next chapter when it is done, so one huge chapter doesn't hold up the rest
+    const int threadCount = qBound(1, m_threadCount, qMax(1, chapters.count()));
+    QThreadPool threadPool;
+    threadPool.setMaxThreadCount(threadCount);
+
+    QAtomicInt nextChapter(0);
+    QMutex statisticsMutex;
+    Chapter *chapterData = chapters.data();
+    const int chapterCount = chapters.count();
+    QVector<QFuture<void>> futures;
+    for (int i=0; i<threadCount; i++) {
+        futures.append(QtConcurrent::run(&threadPool, [=, &container, &statisticsMutex, &nextChapter, &outputNames]() {
+            exportChapters(path, &container, &statisticsMutex, chapterData, chapterCount, &nextChapter, outputNames);
+        }));
+    }
+    for (QFuture<void> &future : futures) {
+        future.waitForFinished();
+    }
+
+    Statistics bookStatistics;
+    bookStatistics.books = 1;
+    for (const Chapter &chapter : chapters) {
+        bookStatistics.chapters++;
+        if (!chapter.success) {
+            bookStatistics.failedChapters++;
+        }
+        bookStatistics.inputBytes += chapter.inputBytes;
+        bookStatistics.outputBytes += chapter.outputBytes;
+    }
+    bookStatistics.elapsedMs = timer.elapsed();
+
+    qInfo().noquote() << QString("%1: %2 chapters (%3 failed), %4 KB in, %5 KB out, %6 ms, %7 MB/s")
+                         .arg(path)
+                         .arg(bookStatistics.chapters)
+                         .arg(bookStatistics.failedChapters)
+                         .arg(bookStatistics.inputBytes / 1024)
+                         .arg(bookStatistics.outputBytes / 1024)
+                         .arg(bookStatistics.elapsedMs)
+                         .arg(bookStatistics.megabytesPerSecond(), 0, 'f', 2);
+
+    m_statistics.books++;
+    m_statistics.chapters += bookStatistics.chapters;
+    m_statistics.failedChapters += bookStatistics.failedChapters;
+    m_statistics.inputBytes += bookStatistics.inputBytes;
+    m_statistics.outputBytes += bookStatistics.outputBytes;
+    m_statistics.elapsedMs += bookStatistics.elapsedMs;
+
+    return bookStatistics.failedChapters == 0;
+}
+
+QString EPubExporter::outputFolderName(const QString &path)
+{
+    const QFileInfo fileInfo(path);
+    const QByteArray pathHash = QCryptographicHash::hash(fileInfo.absoluteFilePath().toUtf8(), QCryptographicHash::Sha1);
+    return fileInfo.completeBaseName() + '-' + QString::fromLatin1(pathHash.toHex().left(8));
+}
+
+void EPubExporter::exportChapters(const QString &bookPath, EPubContainer *bookContainer, QMutex *statisticsMutex, Chapter *chapters, int count, QAtomicInt *nextChapter, const QHash<QString, QString> &outputNames)
+{
+    // KArchive isn't thread safe, so every thread needs its own
+    EPubContainer container(nullptr);
+    container.setStatisticsEnabled(bookContainer->statisticsEnabled());
+    QObject::connect(&container, &EPubContainer::errorHappened, [](const QString &error) {
+        qWarning().noquote() << error;
+    });
+    if (!container.openFile(bookPath)) {
+        return;
+    }
+
+    ChapterPreprocessor preprocessor;
+    preprocessor.setOutputFormat(m_format == Html ? ChapterPreprocessor::ContinuousHtml : ChapterPreprocessor::PlainText);
+
+    // The paths only make sense inside the archive, so the images are
+    // embedded in the HTML instead
+    preprocessor.setImageHandler([&](ChapterPreprocessor::Attributes &attributes) {
+        for (QPair<QString, QString> &attribute : attributes) {
+            if (attribute.first != "src" || attribute.second.startsWith("data:")) {
+                continue;
+            }
+            const QString path = QUrl(attribute.second).path();
+            const QByteArray data = container.readFile(path, EPubContainer::ImageConsumer);
+            if (data.isEmpty()) {
+                continue;
+            }
+            QByteArray mimetype = container.getEpubItem(container.getItemId(path)).mimetype;
+            if (mimetype.isEmpty()) {
+                mimetype = QMimeDatabase().mimeTypeForFileNameAndData(path, data).name().toLatin1();
+            }
+            attribute.second = QString::fromLatin1("data:" + mimetype + ";base64," + data.toBase64());
+        }
+    });
+    preprocessor.setSvgHandler([](const QByteArray &svg) {
+        return QString::fromLatin1("data:image/svg+xml;base64," + svg.toBase64());
+    });
+    preprocessor.setResourceLoader([&](const QString &path) {
+        return container.readFile(path, EPubContainer::SvgConsumer);
+    });
+    preprocessor.setStyleSheetLoader([&](const QString &path) {
+        return QString::fromUtf8(container.readFile(QUrl(path).path(), EPubContainer::StyleSheetConsumer));
+    });
+
+    // Links to other chapters go to their exported files, links to
+    // anything else in the archive are dropped, only the text is kept
+    preprocessor.setLinkHandler([&](ChapterPreprocessor::Attributes &attributes) {
+        for (int i=0; i<attributes.count(); i++) {
+            if (attributes[i].first != "href") {
+                continue;
+            }
+            const QUrl url(attributes[i].second);
+            if (!url.scheme().isEmpty()) {
+                continue;
+            }
+            const QString outputName = outputNames.value(url.path());
+            if (outputName.isEmpty()) {
+                attributes.removeAt(i);
+                return;
+            }
+            attributes[i].second = url.hasFragment() ? outputName + '#' + url.fragment(QUrl::FullyEncoded) : outputName;
+        }
+    });
+
+    QFile output;
+    qint64 bytesWritten = 0;
+    bool writeFailed = false;
+
+    // Written as it comes, so we never hold more than a segment
+    preprocessor.setSegmentHandler([&](const QString &text) {
+        const QByteArray data = text.toUtf8();
+        if (output.write(data) != data.size()) {
+            writeFailed = true;
+            return;
+        }
+        bytesWritten += data.size();
+    });
+
+    for (int index = nextChapter->fetchAndAddRelaxed(1); index < count; index = nextChapter->fetchAndAddRelaxed(1)) {
+        Chapter &chapter = chapters[index];
+
+        EpubChunkReader reader = container.getChunkReader(chapter.path, EPubContainer::ChapterConsumer);
+        if (!reader.isValid()) {
+            continue;
+        }
+
+        output.setFileName(chapter.outputPath);
+        if (!output.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            qWarning() << "Unable to open" << chapter.outputPath << "for writing:" << output.errorString();
+            continue;
+        }
+
+        bytesWritten = 0;
+        writeFailed = false;
+        const bool success = preprocessor.process(reader, chapter.path);
+        if (!success) {
+            qWarning().noquote() << "Problem while reading chapter:" << preprocessor.errorString();
+        }
+        if (writeFailed) {
+            qWarning() << "Failed to write" << chapter.outputPath << output.errorString();
+        }
+        output.close();
+
+        chapter.inputBytes = reader.bytesRead();
+        chapter.outputBytes = bytesWritten;
+        chapter.success = success && !writeFailed;
+    }
+
+    // Reported once for the whole book, instead of once per thread
+    QMutexLocker locker(statisticsMutex);
+    bookContainer->mergeStatistics(&container);
+}
@@ -0,0 +1,67 @@
+#ifndef EPUBEXPORTER_H
+#define EPUBEXPORTER_H
+
+#include <QString>
+#include <QStringList>
+#include <QHash>
+#include <QAtomicInt>
+
+class EPubContainer;
+class QMutex;
+
+// Writes the chapters of books as plain text or cleaned up HTML, one file
+// per chapter, without needing a display. Chapters are converted in
+// parallel, each thread with its own EPubContainer, and streamed straight
+// to disk so memory use doesn't depend on the size of the chapters. The
+// HTML has the images, SVGs and stylesheets embedded and links between
+// chapters go to the exported files, so each folder stands on its own.
+class EPubExporter
+{
+public:
+    enum Format {
+        PlainText,
+        Html
+    };
+
+    struct Statistics {
+        int books = 0;
+        int chapters = 0;
+        int failedChapters = 0;
+        qint64 inputBytes = 0; // uncompressed
+        qint64 outputBytes = 0;
+        qint64 elapsedMs = 0;
+
+        double megabytesPerSecond() const;
+    };
+
+    EPubExporter(const QString &outputFolder, Format format);
+
+    void setThreadCount(int threads) { m_threadCount = threads; }
+
+    bool exportFile(const QString &path);
+
+    // The book's name and a hash of its path, so books with the same name
+    // from different folders don't overwrite each other
+    static QString outputFolderName(const QString &path);
+
+    const Statistics &statistics() const { return m_statistics; }
+
+private:
+    struct Chapter {
+        int index = 0;
+        QString path;
+        QString outputPath;
+        qint64 inputBytes = 0;
+        qint64 outputBytes = 0;
+        bool success = false;
+    };
+
+    void exportChapters(const QString &bookPath, EPubContainer *bookContainer, QMutex *statisticsMutex, Chapter *chapters, int count, QAtomicInt *nextChapter, const QHash<QString, QString> &outputNames);
+
+    QString m_outputFolder;
+    Format m_format;
+    int m_threadCount;
+    Statistics m_statistics;
+};
+
+#endif // EPUBEXPORTER_H
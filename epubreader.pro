@@ -4,7 +4,7 @@
 #
 #-------------------------------------------------
 
-QT       += core gui xml widgets svg
+QT       += core gui xml widgets svg concurrent
 
 ## For debugging CSS
 QT += gui-private
@@ -27,8 +27,20 @@ TEMPLATE = app
 SOURCES += main.cpp\
         widget.cpp \
     epubcontainer.cpp \
-    epubdocument.cpp
+    epubdocument.cpp \
+    memorybudget.cpp \
+    chapterpreprocessor.cpp \
+    epubexporter.cpp \
+    epubsession.cpp \
+    fixedlayoutengine.cpp \
+    previewrenderer.cpp
 
 HEADERS  += widget.h \
     epubcontainer.h \
-    epubdocument.h
+    epubdocument.h \
+    memorybudget.h \
+    chapterpreprocessor.h \
+    epubexporter.h \
+    epubsession.h \
+    fixedlayoutengine.h \
+    previewrenderer.h
@@ -0,0 +1,332 @@
+#include "epubsession.h"
+
+#include "epubcontainer.h"
+#include "memorybudget.h"
+
+#include <QBuffer>
+#include <QCoreApplication>
+#include <QDebug>
+#include <QFileInfo>
+#include <QFontDatabase>
+#include <QFutureWatcher>
+#include <QImageReader>
+#include <QMutex>
+#include <QUrl>
+#include <QtConcurrent>
+
+namespace {
+struct DecodedImage {
+    QImage image;
+    QSize nativeSize;
+};
+
+DecodedImage decodeImageWithSize(const QByteArray &data, const QSize &targetSize)
+{
+    DecodedImage decoded;
+    decoded.image = EPubSession::decodeImageData(data, targetSize, &decoded.nativeSize);
+    return decoded;
+}
+
+struct SessionRegistry {
+    SessionRegistry()
+    {
+        // Created first, so it is still there when the last sessions are deleted
+        MemoryBudget::instance();
+
+        // The sessions remove their fonts when they are deleted, so they
+        // can't be left for the static destructors, the application is
+        // gone by then
+        if (QCoreApplication::instance()) {
+            QObject::connect(QCoreApplication::instance(), &QCoreApplication::aboutToQuit, &EPubSession::releaseUnused);
+        }
+        qAddPostRoutine(&EPubSession::releaseUnused);
+    }
+
+    QMutex mutex;
+    QHash<QString, QWeakPointer<EPubSession>> sessions;
+
+    // Keeps the last few sessions alive, so closing and reopening a book is cheap
+    QList<QSharedPointer<EPubSession>> recent;
+};
+
+const int s_maxRecentSessions = 2;
+}
+
+Q_GLOBAL_STATIC(SessionRegistry, s_registry)
+
+QSharedPointer<EPubSession> EPubSession::open(const QString &path)
+{
+    const QFileInfo fileInfo(path);
+    const QString canonicalPath = fileInfo.canonicalFilePath();
+    if (canonicalPath.isEmpty()) {
+        qWarning() << "Unable to find" << path;
+        return QSharedPointer<EPubSession>();
+    }
+
+    QSharedPointer<EPubSession> session;
+    {
+        QMutexLocker locker(&s_registry->mutex);
+
+        // Forget the ones that are closed
+        for (QHash<QString, QWeakPointer<EPubSession>>::iterator it = s_registry->sessions.begin(); it != s_registry->sessions.end();) {
+            if (it->isNull()) {
+                it = s_registry->sessions.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        session = s_registry->sessions.value(canonicalPath).toStrongRef();
+
+        // Don't reuse it if the file has changed under us
+        if (session && session->m_lastModified != fileInfo.lastModified()) {
+            s_registry->recent.removeAll(session);
+            session.reset();
+        }
+
+        if (!session) {
+            session.reset(new EPubSession(canonicalPath));
+            session->m_lastModified = fileInfo.lastModified();
+            s_registry->sessions.insert(canonicalPath, session);
+        }
+    }
+
+    // Parsing a big book takes a while, so only the ones opening the same
+    // file wait for each other
+    {
+        QMutexLocker openLocker(&session->m_openMutex);
+        if (!session->m_openAttempted) {
+            session->m_opened = session->m_container->openFile(canonicalPath);
+            session->m_openAttempted = true;
+        }
+    }
+
+    QMutexLocker locker(&s_registry->mutex);
+
+    if (!session->m_opened) {
+        if (s_registry->sessions.value(canonicalPath) == session) {
+            s_registry->sessions.remove(canonicalPath);
+        }
+        locker.unlock();
+        return QSharedPointer<EPubSession>();
+    }
+
+    s_registry->recent.removeAll(session);
+    s_registry->recent.prepend(session);
+    QList<QSharedPointer<EPubSession>> dropped;
+    while (s_registry->recent.count() > s_maxRecentSessions) {
+        dropped.append(s_registry->recent.takeLast());
+    }
+    locker.unlock();
+
+    // Deleted here, outside the lock
+    dropped.clear();
+
+    return session;
+}
+
+void EPubSession::releaseUnused()
+{
+    QList<QSharedPointer<EPubSession>> recent;
+    {
+        QMutexLocker locker(&s_registry->mutex);
+        recent.swap(s_registry->recent);
+    }
+    // Deleted here, outside the lock
+}
+
+EPubSession::EPubSession(const QString &path) : QObject(nullptr),
+    m_path(path),
+    m_container(new EPubContainer(this)),
+    m_openAttempted(false),
+    m_opened(false)
+{
+    connect(m_container, &EPubContainer::errorHappened, this, [](QString error) {
+        qWarning().noquote() << error;
+    });
+}
+
+EPubSession::~EPubSession()
+{
+    MemoryBudget::instance()->releaseAll(this);
+
+    for (const int fontId : m_fonts) {
+        QFontDatabase::removeApplicationFont(fontId);
+    }
+}
+
+QImage EPubSession::decodeImageData(QByteArray data, const QSize &targetSize, QSize *nativeSize)
+{
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::ReadOnly);
+    QImageReader reader(&buffer);
+
+    const QSize size = reader.size();
+    if (nativeSize) {
+        *nativeSize = size;
+    }
+
+    // Lets e. g. the JPEG decoder skip most of the work
+    if (size.isValid() && targetSize.isValid() &&
+            (size.width() > targetSize.width() || size.height() > targetSize.height())) {
+        reader.setScaledSize(size.scaled(targetSize, Qt::KeepAspectRatio));
+    }
+
+    return reader.read();
+}
+
+QImage EPubSession::image(const QUrl &url, const QSize &wantedSize)
+{
+    const QString key = url.toString();
+    if (m_failedImages.contains(key)) {
+        return QImage();
+    }
+
+    const QImage image = m_images.value(key);
+    if (!image.isNull()) {
+        MemoryBudget::instance()->touch(this, MemoryBudget::Images, key);
+    }
+
+    // Keep using what we have while a larger one is decoded
+    if (!m_pendingImages.contains(key) &&
+            (image.isNull() || (image.width() < wantedSize.width() && image.height() < wantedSize.height()))) {
+        decodeImage(key, url, wantedSize);
+    }
+
+    return image;
+}
+
+bool EPubSession::loadFont(const QString &path)
+{
+    if (m_fonts.contains(path)) {
+        return true;
+    }
+
+    const QByteArray fontData = m_container->readFile(path, EPubContainer::FontConsumer);
+    if (fontData.isEmpty()) {
+        return false;
+    }
+
+    const int fontId = QFontDatabase::addApplicationFontFromData(fontData);
+    if (fontId == -1) {
+        return false;
+    }
+
+    m_fonts.insert(path, fontId);
+    MemoryBudget::instance()->charge(this, MemoryBudget::Fonts, path, fontData.size());
+    qDebug() << "Loaded font" << QFontDatabase::applicationFontFamilies(fontId);
+
+    return true;
+}
+
+QString EPubSession::storeSvg(const QByteArray &svg)
+{
+    QString svgId = m_svgIds.value(svg);
+    if (!svgId.isEmpty()) {
+        return svgId;
+    }
+
+    svgId = QString::number(m_svgs.count() + 1);
+    m_svgs.insert(svgId, svg);
+    m_svgIds.insert(svg, svgId);
+
+    // We can't recreate these, so they are only accounted for
+    MemoryBudget::instance()->charge(this, MemoryBudget::SvgSources, svgId, svg.size());
+
+    return svgId;
+}
+
+QByteArray EPubSession::readImageData(const QUrl &url)
+{
+    if (url.scheme() == "data") {
+        return decodeDataUrl(url);
+    }
+
+    return m_container->readFile(url.path(), EPubContainer::ImageConsumer);
+}
+
+QByteArray EPubSession::decodeDataUrl(const QUrl &url)
+{
+    QByteArray data = url.path().toUtf8();
+    const int start = data.indexOf(';');
+    if (start == -1) {
+        qWarning() << "unable to decode data:, no ;" << data.left(100);
+        return QByteArray();
+    }
+
+    data = data.mid(start + 1);
+    if (!data.startsWith("base64,")) {
+        qWarning() << "unable to decode data:, unknown encoding" << data.left(100);
+        return QByteArray();
+    }
+
+    return QByteArray::fromBase64(data.mid(data.indexOf(',') + 1));
+}
+
+void EPubSession::decodeImage(const QString &key, const QUrl &url, const QSize &targetSize)
+{
+    // KArchive isn't thread safe, so the compressed data is read here
+    QByteArray data = readImageData(url);
+    if (data.isEmpty()) {
+        m_failedImages.insert(key);
+        return;
+    }
+
+    m_pendingImages.insert(key);
+
+    QFutureWatcher<DecodedImage> *watcher = new QFutureWatcher<DecodedImage>(this);
+    connect(watcher, &QFutureWatcher<DecodedImage>::finished, this, [=]() {
+        const DecodedImage decoded = watcher->result();
+        onImageDecoded(key, decoded.image, decoded.nativeSize);
+        watcher->deleteLater();
+    });
+    watcher->setFuture(QtConcurrent::run(decodeImageWithSize, data, targetSize));
+}
+
+QImage EPubSession::decodeImageNow(const QUrl &url, const QSize &wantedSize)
+{
+    const QString key = url.toString();
+    if (m_failedImages.contains(key)) {
+        return QImage();
+    }
+
+    const QImage image = m_images.value(key);
+    if (!image.isNull() && (image.width() >= wantedSize.width() || image.height() >= wantedSize.height())) {
+        MemoryBudget::instance()->touch(this, MemoryBudget::Images, key);
+        return image;
+    }
+
+    const QByteArray data = readImageData(url);
+    if (data.isEmpty()) {
+        m_failedImages.insert(key);
+        return QImage();
+    }
+
+    const DecodedImage decoded = decodeImageWithSize(data, wantedSize);
+    storeImage(key, decoded.image, decoded.nativeSize);
+    return decoded.image;
+}
+
+void EPubSession::onImageDecoded(const QString &key, const QImage &image, const QSize &nativeSize)
+{
+    m_pendingImages.remove(key);
+    storeImage(key, image, nativeSize);
+    emit imageDecoded(key);
+}
+
+void EPubSession::storeImage(const QString &key, const QImage &image, const QSize &nativeSize)
+{
+    if (nativeSize.isValid()) {
+        m_nativeImageSizes.insert(key, nativeSize);
+    }
+
+    if (image.isNull()) {
+        qWarning() << "Unable to decode image" << key.left(100);
+        m_failedImages.insert(key);
+    } else {
+        m_images.insert(key, image);
+        MemoryBudget::instance()->charge(this, MemoryBudget::Images, key, image.sizeInBytes(), [this](const QString &key) {
+            m_images.remove(key);
+        });
+    }
+}
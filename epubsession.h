@@ -0,0 +1,90 @@
+#ifndef EPUBSESSION_H
+#define EPUBSESSION_H
+
+#include <QObject>
+#include <QDateTime>
+#include <QHash>
+#include <QImage>
+#include <QMutex>
+#include <QSet>
+#include <QSharedPointer>
+#include <QStringList>
+
+class EPubContainer;
+
+// Everything about an opened file that can be shared between all the
+// documents showing it: the parsed container with the archive index,
+// decoded images, embedded fonts and SVG sources. There is only one
+// session per file, get it with open(), it is closed when the last user
+// releases it.
+class EPubSession : public QObject
+{
+    Q_OBJECT
+
+public:
+    static QSharedPointer<EPubSession> open(const QString &path);
+
+    // Drops the sessions kept around for quick reopening
+    static void releaseUnused();
+
+    ~EPubSession();
+
+    QString path() const { return m_path; }
+    EPubContainer *container() const { return m_container; }
+
+    // Returns the best image we have, which might be smaller than wanted
+    // or null, and decodes a better one in the background if needed.
+    // imageDecoded() is emitted when that is done.
+    QImage image(const QUrl &url, const QSize &wantedSize);
+    bool isImagePending(const QString &key) const { return m_pendingImages.contains(key); }
+
+    // Decodes it right away if we don't have a good enough one, doesn't emit imageDecoded()
+    QImage decodeImageNow(const QUrl &url, const QSize &wantedSize);
+
+    QSize nativeImageSize(const QString &key) const { return m_nativeImageSizes.value(key); }
+    void setNativeImageSize(const QString &key, const QSize &size) { m_nativeImageSizes.insert(key, size); }
+
+    // Loads an embedded font, only once per session
+    bool loadFont(const QString &path);
+
+    // Identical SVGs are only stored once, and get the same id every time
+    QString storeSvg(const QByteArray &svg);
+    QByteArray svgData(const QString &id) const { return m_svgs.value(id); }
+
+    QByteArray readImageData(const QUrl &url);
+    static QByteArray decodeDataUrl(const QUrl &url);
+
+    // Scaled down to fit in targetSize while decoding, can be called from any thread
+    static QImage decodeImageData(QByteArray data, const QSize &targetSize, QSize *nativeSize = nullptr);
+
+signals:
+    void imageDecoded(const QString &key);
+
+private:
+    explicit EPubSession(const QString &path);
+
+    void decodeImage(const QString &key, const QUrl &url, const QSize &targetSize);
+    void onImageDecoded(const QString &key, const QImage &image, const QSize &nativeSize);
+    void storeImage(const QString &key, const QImage &image, const QSize &nativeSize);
+
+    QString m_path;
+    QDateTime m_lastModified;
+    EPubContainer *m_container;
+
+    // Held while the container is opened
+    QMutex m_openMutex;
+    bool m_openAttempted;
+    bool m_opened;
+
+    QHash<QString, QImage> m_images;
+    QHash<QString, QSize> m_nativeImageSizes;
+    QSet<QString> m_pendingImages;
+    QSet<QString> m_failedImages;
+
+    QHash<QString, int> m_fonts;
+
+    QHash<QString, QByteArray> m_svgs;
+    QHash<QByteArray, QString> m_svgIds;
+};
+
+#endif // EPUBSESSION_H
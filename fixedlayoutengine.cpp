@@ -0,0 +1,255 @@
+#include "fixedlayoutengine.h"
+
+#include "chapterpreprocessor.h"
+#include "epubcontainer.h"
+#include "epubdocument.h"
+#include "epubsession.h"
+#include "memorybudget.h"
+
+#include <QDebug>
+#include <QFutureWatcher>
+#include <QGuiApplication>
+#include <QtConcurrent>
+
+namespace {
+// Scaled down to fit, but small pages aren't blown up
+QSize fittedSize(const QSize &size, const QSize &targetSize)
+{
+    if (size.width() <= targetSize.width() && size.height() <= targetSize.height()) {
+        return size;
+    }
+    return size.scaled(targetSize, Qt::KeepAspectRatio);
+}
+
+// How many of the following pages to decode before they are shown
+const int s_decodeAhead = 3;
+
+// Pages further away than this from the current one are dropped, along
+// with their sources
+const int s_keepDistance = 8;
+}
+
+FixedLayoutEngine::FixedLayoutEngine(QObject *parent) : QObject(parent),
+    m_currentPage(0),
+    m_generation(0)
+{
+}
+
+FixedLayoutEngine::~FixedLayoutEngine()
+{
+    MemoryBudget::instance()->releaseAll(this);
+}
+
+bool FixedLayoutEngine::isFixedLayout(EPubContainer *container)
+{
+    // EPUB 3, and what e. g. Kindle used before that
+    return container->getMetadata("rendition:layout") == "pre-paginated" ||
+            container->getMetadata("fixed-layout") == "true";
+}
+
+bool FixedLayoutEngine::openDocument(const QString &path)
+{
+    return openDocument(EPubSession::open(path));
+}
+
+bool FixedLayoutEngine::openDocument(const QSharedPointer<EPubSession> &session)
+{
+    clearCache();
+    m_sources.clear();
+    m_currentPage = 0;
+
+    m_session = session;
+    if (!m_session) {
+        m_pages.clear();
+        return false;
+    }
+
+    m_pages = m_session->container()->getLinearItems();
+    return !m_pages.isEmpty();
+}
+
+void FixedLayoutEngine::setPageSize(const QSize &size)
+{
+    if (size == m_pageSize) {
+        return;
+    }
+
+    m_pageSize = size;
+    clearCache();
+}
+
+QImage FixedLayoutEngine::page(int index)
+{
+    if (index < 0 || index >= m_pages.count()) {
+        return QImage();
+    }
+    m_currentPage = index;
+
+    const QImage image = m_renderedPages.value(index);
+    if (!image.isNull()) {
+        MemoryBudget::instance()->touch(this, MemoryBudget::Images, QString::number(index));
+    }
+
+    // The one we are asked for first, the pool runs them in order
+    requestPage(index);
+    for (int i=index + 1; i<=index + s_decodeAhead; i++) {
+        requestPage(i);
+    }
+    requestPage(index - 1);
+
+    dropDistantPages();
+
+    return image;
+}
+
+FixedLayoutEngine::PageSource FixedLayoutEngine::pageSource(int index)
+{
+    if (m_sources.contains(index)) {
+        return m_sources.value(index);
+    }
+
+    PageSource source;
+    EPubContainer *container = m_session->container();
+    const EpubItem item = container->getEpubItem(m_pages[index]);
+
+    if (item.mimetype.startsWith("image/svg")) {
+        source.svg = container->readFile(item.path, EPubContainer::SvgConsumer);
+    } else if (item.mimetype.startsWith("image/")) {
+        source.imageUrl = QUrl(item.path);
+    } else {
+        // The pages are just wrappers around an image or SVG, so we only need
+        // the first of either, no need to build a document
+        QString svgImagePath;
+        ChapterPreprocessor preprocessor;
+        preprocessor.setImageHandler([&](ChapterPreprocessor::Attributes &attributes) {
+            for (const QPair<QString, QString> &attribute : attributes) {
+                if (attribute.first == "src" && source.imageUrl.isEmpty() && source.svg.isEmpty()) {
+                    source.imageUrl = QUrl(attribute.second);
+                }
+            }
+        });
+        preprocessor.setResourceLoader([&](const QString &path) {
+            if (svgImagePath.isEmpty()) {
+                svgImagePath = path;
+            }
+            return QByteArray();
+        });
+        preprocessor.setSvgHandler([&](const QByteArray &svg) {
+            if (source.imageUrl.isEmpty() && source.svg.isEmpty()) {
+                // The usual way of scaling a page image, cheaper to decode it directly
+                if (!svgImagePath.isEmpty()) {
+                    source.imageUrl = QUrl(svgImagePath);
+                } else {
+                    source.svg = svg;
+                }
+            }
+            return QString();
+        });
+        preprocessor.setSegmentHandler([](const QString &) {});
+
+        EpubChunkReader reader = container->getChunkReader(item.path, EPubContainer::ChapterConsumer);
+        if (!reader.isValid() || !preprocessor.process(reader, item.path)) {
+            qWarning().noquote() << "Problem while reading page" << item.path << preprocessor.errorString();
+        }
+    }
+
+    m_sources.insert(index, source);
+    return source;
+}
+
+void FixedLayoutEngine::requestPage(int index)
+{
+    if (index < 0 || index >= m_pages.count() || !m_pageSize.isValid()) {
+        return;
+    }
+    if (m_renderedPages.contains(index) || m_pendingPages.contains(index) || m_failedPages.contains(index)) {
+        return;
+    }
+
+    const QSize targetSize = m_pageSize * qGuiApp->devicePixelRatio();
+    const PageSource source = pageSource(index);
+
+    QFuture<QImage> future;
+    if (!source.svg.isEmpty()) {
+        QSize size = EPubDocument::svgIntrinsicSize(source.svg);
+        size = size.isValid() ? fittedSize(size, targetSize) : targetSize;
+        future = QtConcurrent::run(EPubDocument::svgRenderPool(), &EPubDocument::renderSvg, source.svg, size);
+    } else if (!source.imageUrl.isEmpty()) {
+        // KArchive isn't thread safe, so the compressed data is read here
+        const QByteArray data = m_session->readImageData(source.imageUrl);
+        future = QtConcurrent::run([data, targetSize]() {
+            QImage image = EPubSession::decodeImageData(data, targetSize);
+            if (image.hasAlphaChannel()) {
+                image = image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+            }
+            return image;
+        });
+    } else {
+        qWarning() << "Nothing to show on page" << index;
+        m_failedPages.insert(index);
+        return;
+    }
+
+    m_pendingPages.insert(index);
+
+    const int generation = m_generation;
+    QFutureWatcher<QImage> *watcher = new QFutureWatcher<QImage>(this);
+    connect(watcher, &QFutureWatcher<QImage>::finished, this, [=]() {
+        watcher->deleteLater();
+        if (generation != m_generation) {
+            return;
+        }
+        onPageRendered(index, watcher->result());
+    });
+    watcher->setFuture(future);
+}
+
+void FixedLayoutEngine::onPageRendered(int index, const QImage &image)
+{
+    m_pendingPages.remove(index);
+
+    if (image.isNull()) {
+        qWarning() << "Unable to render page" << index;
+        m_failedPages.insert(index);
+        emit pageReady(index);
+        return;
+    }
+
+    QImage page = image;
+    page.setDevicePixelRatio(qGuiApp->devicePixelRatio());
+    m_renderedPages.insert(index, page);
+
+    MemoryBudget::instance()->charge(this, MemoryBudget::Images, QString::number(index), page.sizeInBytes(), [this](const QString &key) {
+        m_renderedPages.remove(key.toInt());
+    });
+
+    emit pageReady(index);
+}
+
+void FixedLayoutEngine::dropDistantPages()
+{
+    for (const int index : m_renderedPages.keys()) {
+        if (qAbs(index - m_currentPage) > s_keepDistance) {
+            m_renderedPages.remove(index);
+            MemoryBudget::instance()->release(this, MemoryBudget::Images, QString::number(index));
+        }
+    }
+
+    // SVG pages keep their whole source here
+    for (const int index : m_sources.keys()) {
+        if (qAbs(index - m_currentPage) > s_keepDistance) {
+            m_sources.remove(index);
+        }
+    }
+}
+
+void FixedLayoutEngine::clearCache()
+{
+    // Anything still being decoded is for the wrong size
+    m_generation++;
+    m_pendingPages.clear();
+    m_failedPages.clear();
+
+    m_renderedPages.clear();
+    MemoryBudget::instance()->releaseAll(this);
+}
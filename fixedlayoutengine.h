@@ -0,0 +1,71 @@
+#ifndef FIXEDLAYOUTENGINE_H
+#define FIXEDLAYOUTENGINE_H
+
+#include <QObject>
+#include <QHash>
+#include <QImage>
+#include <QSet>
+#include <QSharedPointer>
+#include <QStringList>
+#include <QUrl>
+
+class EPubContainer;
+class EPubSession;
+
+// Shows pre-paginated books (comics and other fixed layout books) without
+// going through QTextDocument: each spine item is one page, and is drawn
+// from its image or SVG directly. The following pages are decoded ahead in
+// the background, so turning pages doesn't have to wait.
+class FixedLayoutEngine : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit FixedLayoutEngine(QObject *parent);
+    ~FixedLayoutEngine();
+
+    static bool isFixedLayout(EPubContainer *container);
+
+    bool openDocument(const QString &path);
+    bool openDocument(const QSharedPointer<EPubSession> &session);
+
+    int pageCount() const { return m_pages.count(); }
+
+    // In device independent pixels, bigger pages are scaled down to fit inside it
+    void setPageSize(const QSize &size);
+    QSize pageSize() const { return m_pageSize; }
+
+    // Null until it is decoded, pageReady() is emitted when it is
+    QImage page(int index);
+    bool isPagePending(int index) const { return m_pendingPages.contains(index); }
+    bool isPageFailed(int index) const { return m_failedPages.contains(index); }
+
+signals:
+    // Also when it failed, then page() stays null
+    void pageReady(int index);
+
+private:
+    struct PageSource {
+        QUrl imageUrl;
+        QByteArray svg;
+    };
+
+    PageSource pageSource(int index);
+    void requestPage(int index);
+    void onPageRendered(int index, const QImage &image);
+    void dropDistantPages();
+    void clearCache();
+
+    QSharedPointer<EPubSession> m_session;
+    QStringList m_pages; // item ids
+    QHash<int, PageSource> m_sources; // around the current page
+    QHash<int, QImage> m_renderedPages;
+    QSet<int> m_pendingPages;
+    QSet<int> m_failedPages;
+
+    QSize m_pageSize;
+    int m_currentPage;
+    int m_generation; // so we can ignore what was started before a resize
+};
+
+#endif // FIXEDLAYOUTENGINE_H
@@ -1,9 +1,207 @@
 #include "widget.h"
+#include "epubexporter.h"
+#include "previewrenderer.h"
 #include <QApplication>
+#include <QCommandLineParser>
 #include <QDebug>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QProcess>
+#include <QThread>
+#include <functional>
+
+static bool hasArgument(int argc, char *argv[], const char *name)
+{
+    const int length = qstrlen(name);
+    for (int i=1; i<argc; i++) {
+        if (qstrncmp(argv[i], name, length) == 0 && (argv[i][length] == '\0' || argv[i][length] == '=')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Doesn't need a display, so we can run on batch nodes
+static int exportBooks(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Exports the chapters of EPUB files as text or HTML");
+    parser.addHelpOption();
+    const QCommandLineOption exportOption("export", "Write the chapters to <folder>, one subfolder per book.", "folder");
+    const QCommandLineOption formatOption("format", "Output format, text or html.", "format", "text");
+    const QCommandLineOption jobsOption("jobs", "Number of chapters to convert in parallel.", "count", QString::number(QThread::idealThreadCount()));
+    parser.addOptions({exportOption, formatOption, jobsOption});
+    parser.addPositionalArgument("files", "EPUB files to export.", "files...");
+    parser.process(a);
+
+    const QStringList files = parser.positionalArguments();
+    if (files.isEmpty()) {
+        parser.showHelp(1);
+    }
+
+    const QString format = parser.value(formatOption);
+    if (format != "text" && format != "html") {
+        qWarning() << "Unknown format" << format;
+        return 1;
+    }
+
+    EPubExporter exporter(parser.value(exportOption), format == "html" ? EPubExporter::Html : EPubExporter::PlainText);
+    exporter.setThreadCount(parser.value(jobsOption).toInt());
+
+    bool success = true;
+    for (const QString &file : files) {
+        success = exporter.exportFile(file) && success;
+    }
+
+    const EPubExporter::Statistics &statistics = exporter.statistics();
+    qInfo().noquote() << QString("Exported %1 chapters from %2 books (%3 failed), %4 MB in %5 ms, %6 MB/s")
+                         .arg(statistics.chapters)
+                         .arg(statistics.books)
+                         .arg(statistics.failedChapters)
+                         .arg(statistics.inputBytes / (1024. * 1024.), 0, 'f', 1)
+                         .arg(statistics.elapsedMs)
+                         .arg(statistics.megabytesPerSecond(), 0, 'f', 2);
+
+    return success ? 0 : 1;
+}
+
+// One process per book, the text layout has to happen in the main thread,
+// and a broken book can't take the rest down with it
+static bool renderInWorkers(const QStringList &arguments, const QStringList &files, int jobs)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    QStringList queue = files;
+    int running = 0;
+    int failed = 0;
+    QEventLoop loop;
+
+    std::function<void()> startWorkers = [&]() {
+        while (running < jobs && !queue.isEmpty()) {
+            const QString file = queue.takeFirst();
+
+            QProcess *process = new QProcess;
+            process->setProcessChannelMode(QProcess::ForwardedChannels);
+            process->start(QCoreApplication::applicationFilePath(), QStringList(arguments) << file);
+            if (!process->waitForStarted()) {
+                qWarning() << "Unable to start worker for" << file << process->errorString();
+                delete process;
+                failed++;
+                continue;
+            }
+            running++;
+
+            QObject::connect(process, QOverload<int, QProcess::ExitStatus>::of(&QProcess::finished), [&, process, file](int exitCode, QProcess::ExitStatus exitStatus) {
+                if (exitStatus != QProcess::NormalExit) {
+                    qWarning() << "Worker crashed while rendering" << file;
+                }
+                if (exitStatus != QProcess::NormalExit || exitCode != 0) {
+                    failed++;
+                }
+                process->deleteLater();
+                running--;
+
+                startWorkers();
+                if (running == 0) {
+                    loop.quit();
+                }
+            });
+        }
+    };
+
+    startWorkers();
+    if (running > 0) {
+        loop.exec();
+    }
+
+    qInfo().noquote() << QString("Rendered previews of %1 books (%2 failed) in %3 ms")
+                         .arg(files.count())
+                         .arg(failed)
+                         .arg(timer.elapsed());
+
+    return failed == 0;
+}
+
+// For generating previews on servers, without a display
+static int renderPreviews(int argc, char *argv[])
+{
+    if (!qEnvironmentVariableIsSet("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    QGuiApplication a(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Renders the first pages of EPUB files as PNG images");
+    parser.addHelpOption();
+    const QCommandLineOption renderOption("render-previews", "Write the pages to <folder>, one subfolder per book, named after it and a hash of its path.", "folder");
+    const QCommandLineOption pagesOption("pages", "Number of pages to render from each book.", "count", "1");
+    const QCommandLineOption sizeOption("size", "Page size in pixels.", "WIDTHxHEIGHT", "600x800");
+    const QCommandLineOption jobsOption("jobs", "Number of books to render in parallel.", "count", QString::number(QThread::idealThreadCount()));
+    parser.addOptions({renderOption, pagesOption, sizeOption, jobsOption});
+    parser.addPositionalArgument("files", "EPUB files to render.", "files...");
+    parser.process(a);
+
+    const QStringList files = parser.positionalArguments();
+    if (files.isEmpty()) {
+        parser.showHelp(1);
+    }
+
+    const QStringList sizeValues = parser.value(sizeOption).split('x');
+    const QSize pageSize = sizeValues.count() == 2 ? QSize(sizeValues[0].toInt(), sizeValues[1].toInt()) : QSize();
+    if (pageSize.isEmpty()) {
+        qWarning() << "Invalid page size" << parser.value(sizeOption);
+        return 1;
+    }
+
+    const int pageCount = parser.value(pagesOption).toInt();
+    if (pageCount < 1) {
+        qWarning() << "Invalid page count" << parser.value(pagesOption);
+        return 1;
+    }
+
+    const int jobs = qMax(1, parser.value(jobsOption).toInt());
+    if (jobs > 1 && files.count() > 1) {
+        const QStringList workerArguments = {
+            "--render-previews", parser.value(renderOption),
+            "--pages", QString::number(pageCount),
+            "--size", parser.value(sizeOption),
+            "--jobs", "1"
+        };
+        return renderInWorkers(workerArguments, files, jobs) ? 0 : 1;
+    }
+
+    PreviewRenderer renderer(parser.value(renderOption), pageSize, pageCount);
+
+    bool success = true;
+    for (const QString &file : files) {
+        success = renderer.renderFile(file) && success;
+    }
+
+    if (files.count() > 1) {
+        const PreviewRenderer::Statistics &statistics = renderer.statistics();
+        qInfo().noquote() << QString("Rendered %1 pages from %2 books (%3 failed), %4 ms loading, %5 ms rendering")
+                             .arg(statistics.pages)
+                             .arg(statistics.books)
+                             .arg(statistics.failedBooks)
+                             .arg(statistics.loadMs)
+                             .arg(statistics.renderMs);
+    }
+
+    return success ? 0 : 1;
+}
 
 int main(int argc, char *argv[])
 {
+    if (hasArgument(argc, argv, "--export")) {
+        return exportBooks(argc, argv);
+    }
+    if (hasArgument(argc, argv, "--render-previews")) {
+        return renderPreviews(argc, argv);
+    }
+
     QApplication a(argc, argv);
     a.setQuitOnLastWindowClosed(true);
 
@@ -0,0 +1,244 @@
+#include "memorybudget.h"
+
+#include <QDebug>
+#include <QThread>
+#include <algorithm>
+
+MemoryBudget *MemoryBudget::instance()
+{
+    static MemoryBudget budget;
+    return &budget;
+}
+
+QString MemoryBudget::categoryName(Category category)
+{
+    switch(category) {
+    case SvgSources:
+        return "SVG sources";
+    case SvgRasters:
+        return "SVG rasters";
+    case Images:
+        return "Images";
+    case Fonts:
+        return "Fonts";
+    case ChapterDocuments:
+        return "Chapter documents";
+    default:
+        return "Unknown";
+    }
+}
+
+MemoryBudget::MemoryBudget() :
+    m_totalUsage(0),
+    m_limit(0),
+    m_useCounter(0)
+{
+    for (int i=0; i<CategoryCount; i++) {
+        m_usage[i] = 0;
+    }
+
+    bool ok = false;
+    const qint64 megabytes = qEnvironmentVariableIntValue("EPUBREADER_MEMORY_BUDGET", &ok);
+    if (ok && megabytes > 0) {
+        m_limit = megabytes * 1024 * 1024;
+    }
+}
+
+void MemoryBudget::setLimit(qint64 bytes)
+{
+    QList<Victim> victims;
+    {
+        QMutexLocker locker(&m_mutex);
+        m_limit = qMax(0ll, bytes);
+        victims = queueForeignVictims(takeVictims(nullptr, EntryKey()));
+    }
+
+    for (const Victim &victim : victims) {
+        victim.evictor(victim.key.second);
+    }
+    if (!victims.isEmpty()) {
+        emit usageChanged(totalUsage());
+    }
+}
+
+qint64 MemoryBudget::limit() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_limit;
+}
+
+qint64 MemoryBudget::usage(Category category) const
+{
+    Q_ASSERT(category >= 0 && category < CategoryCount);
+
+    QMutexLocker locker(&m_mutex);
+    return m_usage[category];
+}
+
+qint64 MemoryBudget::totalUsage() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_totalUsage;
+}
+
+void MemoryBudget::charge(QObject *owner, Category category, const QString &key, qint64 bytes, const Evictor &evictor)
+{
+    Q_ASSERT(category >= 0 && category < CategoryCount);
+
+    const EntryKey entryKey(category, key);
+    QList<Victim> victims;
+    qint64 total;
+    {
+        QMutexLocker locker(&m_mutex);
+
+        Entry &entry = m_entries[owner][entryKey];
+        m_usage[category] += bytes - entry.bytes;
+        m_totalUsage += bytes - entry.bytes;
+        entry.bytes = bytes;
+        entry.lastUsed = ++m_useCounter;
+        entry.evictor = evictor;
+
+        // Never evict what we're adding, the caller is about to use it
+        victims = queueForeignVictims(takeVictims(owner, entryKey));
+        total = m_totalUsage;
+    }
+
+    // Evict outside the lock, the evictors touch their own caches
+    for (const Victim &victim : victims) {
+        victim.evictor(victim.key.second);
+    }
+
+    emit usageChanged(total);
+}
+
+void MemoryBudget::touch(QObject *owner, Category category, const QString &key)
+{
+    QMutexLocker locker(&m_mutex);
+
+    QHash<QObject*, QHash<EntryKey, Entry>>::iterator ownerIterator = m_entries.find(owner);
+    if (ownerIterator == m_entries.end()) {
+        return;
+    }
+
+    QHash<EntryKey, Entry>::iterator it = ownerIterator->find(EntryKey(category, key));
+    if (it != ownerIterator->end()) {
+        it->lastUsed = ++m_useCounter;
+    }
+}
+
+void MemoryBudget::release(QObject *owner, Category category, const QString &key)
+{
+    qint64 total;
+    {
+        QMutexLocker locker(&m_mutex);
+
+        QHash<QObject*, QHash<EntryKey, Entry>>::iterator ownerIterator = m_entries.find(owner);
+        if (ownerIterator == m_entries.end()) {
+            return;
+        }
+
+        QHash<EntryKey, Entry>::iterator it = ownerIterator->find(EntryKey(category, key));
+        if (it == ownerIterator->end()) {
+            return;
+        }
+
+        m_usage[category] -= it->bytes;
+        m_totalUsage -= it->bytes;
+        ownerIterator->erase(it);
+        if (ownerIterator->isEmpty()) {
+            m_entries.erase(ownerIterator);
+        }
+        total = m_totalUsage;
+    }
+
+    emit usageChanged(total);
+}
+
+void MemoryBudget::releaseAll(QObject *owner)
+{
+    qint64 total;
+    {
+        QMutexLocker locker(&m_mutex);
+
+        const QHash<EntryKey, Entry> entries = m_entries.take(owner);
+        if (entries.isEmpty()) {
+            return;
+        }
+
+        for (QHash<EntryKey, Entry>::const_iterator it = entries.constBegin(); it != entries.constEnd(); ++it) {
+            m_usage[it.key().first] -= it->bytes;
+            m_totalUsage -= it->bytes;
+        }
+        total = m_totalUsage;
+    }
+
+    emit usageChanged(total);
+}
+
+QList<MemoryBudget::Victim> MemoryBudget::queueForeignVictims(const QList<Victim> &victims)
+{
+    // Owners in other threads get it queued to their own thread. This is
+    // done while we hold the lock, so it can't race with releaseAll() from
+    // the destructor of the owner, and QObject drops the events still
+    // queued when it is destroyed.
+    QList<Victim> localVictims;
+    for (const Victim &victim : victims) {
+        if (victim.owner->thread() == QThread::currentThread()) {
+            localVictims.append(victim);
+            continue;
+        }
+
+        const Evictor evictor = victim.evictor;
+        const QString key = victim.key.second;
+        QMetaObject::invokeMethod(victim.owner, [evictor, key]() {
+            evictor(key);
+        }, Qt::QueuedConnection);
+    }
+    return localVictims;
+}
+
+QList<MemoryBudget::Victim> MemoryBudget::takeVictims(QObject *keepOwner, const EntryKey &keepKey)
+{
+    QList<Victim> victims;
+    if (m_limit <= 0 || m_totalUsage <= m_limit) {
+        return victims;
+    }
+
+    // Eviction is rare, so just collect and sort everything evictable
+    QVector<Victim> candidates;
+    for (QHash<QObject*, QHash<EntryKey, Entry>>::const_iterator ownerIt = m_entries.constBegin(); ownerIt != m_entries.constEnd(); ++ownerIt) {
+        for (QHash<EntryKey, Entry>::const_iterator it = ownerIt->constBegin(); it != ownerIt->constEnd(); ++it) {
+            if (!it->evictor) {
+                continue;
+            }
+            if (ownerIt.key() == keepOwner && it.key() == keepKey) {
+                continue;
+            }
+            candidates.append({ownerIt.key(), it.key(), it->lastUsed, it->evictor});
+        }
+    }
+    std::sort(candidates.begin(), candidates.end(), [](const Victim &a, const Victim &b) {
+        return a.lastUsed < b.lastUsed;
+    });
+
+    for (const Victim &candidate : candidates) {
+        if (m_totalUsage <= m_limit) {
+            break;
+        }
+
+        QHash<EntryKey, Entry> &ownerEntries = m_entries[candidate.owner];
+        const qint64 bytes = ownerEntries.take(candidate.key).bytes;
+        if (ownerEntries.isEmpty()) {
+            m_entries.remove(candidate.owner);
+        }
+        m_usage[candidate.key.first] -= bytes;
+        m_totalUsage -= bytes;
+        victims.append(candidate);
+    }
+
+    if (m_totalUsage > m_limit) {
+        qWarning() << "Unable to get memory usage below budget," << m_totalUsage << "bytes in use, limit" << m_limit;
+    }
+
+    return victims;
+}
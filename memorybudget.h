@@ -0,0 +1,81 @@
+#ifndef MEMORYBUDGET_H
+#define MEMORYBUDGET_H
+
+#include <QObject>
+#include <QHash>
+#include <QMutex>
+#include <QPair>
+#include <functional>
+
+// Keeps track of how much memory the different caches hold on to, and evicts
+// the least recently used entries across all caches when we go over budget.
+//
+// The budget is set with setLimit() or the EPUBREADER_MEMORY_BUDGET
+// environment variable (in megabytes), 0 means no limit.
+class MemoryBudget : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum Category {
+        SvgSources,
+        SvgRasters,
+        Images,
+        Fonts,
+        ChapterDocuments,
+        CategoryCount
+    };
+
+    // Called when an entry is evicted, should drop the cached data without
+    // calling back into the MemoryBudget. Entries without one are only counted.
+    // Always runs in the thread of the owner, owners have to call releaseAll()
+    // when they are destroyed.
+    typedef std::function<void(const QString &key)> Evictor;
+
+    static MemoryBudget *instance();
+    static QString categoryName(Category category);
+
+    void setLimit(qint64 bytes);
+    qint64 limit() const;
+
+    qint64 usage(Category category) const;
+    qint64 totalUsage() const;
+
+    void charge(QObject *owner, Category category, const QString &key, qint64 bytes, const Evictor &evictor = Evictor());
+    void touch(QObject *owner, Category category, const QString &key);
+    void release(QObject *owner, Category category, const QString &key);
+    void releaseAll(QObject *owner);
+
+signals:
+    void usageChanged(qint64 totalBytes);
+
+private:
+    typedef QPair<int, QString> EntryKey;
+
+    struct Entry {
+        qint64 bytes = 0;
+        quint64 lastUsed = 0;
+        Evictor evictor;
+    };
+
+    struct Victim {
+        QObject *owner;
+        EntryKey key;
+        quint64 lastUsed;
+        Evictor evictor;
+    };
+
+    MemoryBudget();
+
+    QList<Victim> takeVictims(QObject *keepOwner, const EntryKey &keepKey);
+    QList<Victim> queueForeignVictims(const QList<Victim> &victims);
+
+    mutable QMutex m_mutex;
+    QHash<QObject*, QHash<EntryKey, Entry>> m_entries;
+    qint64 m_usage[CategoryCount];
+    qint64 m_totalUsage;
+    qint64 m_limit;
+    quint64 m_useCounter;
+};
+
+#endif // MEMORYBUDGET_H
@@ -0,0 +1,188 @@
+#include "previewrenderer.h"
+
+#include "epubdocument.h"
+#include "epubexporter.h"
+#include "epubsession.h"
+#include "fixedlayoutengine.h"
+
+#include <QAbstractTextDocumentLayout>
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QGuiApplication>
+#include <QImage>
+#include <QPainter>
+
+PreviewRenderer::PreviewRenderer(const QString &outputFolder, const QSize &pageSize, int pageCount) :
+    m_outputFolder(outputFolder),
+    m_pageSize(pageSize),
+    m_pageCount(pageCount)
+{
+}
+
+bool PreviewRenderer::renderFile(const QString &path)
+{
+    const QString bookFolder = EPubExporter::outputFolderName(path);
+    QDir outputDir(m_outputFolder);
+    if (!outputDir.mkpath(bookFolder) || !outputDir.cd(bookFolder)) {
+        qWarning() << "Unable to create output folder" << outputDir.filePath(bookFolder);
+        return false;
+    }
+
+    Statistics bookStatistics;
+    bool success = false;
+
+    QSharedPointer<EPubSession> session = EPubSession::open(path);
+    if (!session) {
+        qWarning() << "Failed to open" << path;
+    } else if (FixedLayoutEngine::isFixedLayout(session->container())) {
+        success = renderFixedLayout(session, outputDir, &bookStatistics);
+    } else {
+        success = renderReflowable(session, outputDir, &bookStatistics);
+    }
+    session.reset();
+
+    // Nobody is going to open it again
+    EPubSession::releaseUnused();
+
+    qInfo().noquote() << QString("%1: %2 pages, loaded in %3 ms, rendered in %4 ms%5")
+                         .arg(path)
+                         .arg(bookStatistics.pages)
+                         .arg(bookStatistics.loadMs)
+                         .arg(bookStatistics.renderMs)
+                         .arg(success ? "" : ", failed");
+
+    m_statistics.books++;
+    if (!success) {
+        m_statistics.failedBooks++;
+    }
+    m_statistics.pages += bookStatistics.pages;
+    m_statistics.loadMs += bookStatistics.loadMs;
+    m_statistics.renderMs += bookStatistics.renderMs;
+
+    return success;
+}
+
+bool PreviewRenderer::renderReflowable(const QSharedPointer<EPubSession> &session, const QDir &outputDir, Statistics *bookStatistics)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    EPubDocument document(nullptr);
+    document.setPageSize(m_pageSize);
+    document.setPageLimit(m_pageCount);
+    document.setSynchronousResources(true);
+    document.openDocument(session);
+    if (!document.loaded()) {
+        return false;
+    }
+
+    // Usually done after the first chapters, but they might not have been enough
+    if (document.isLoading()) {
+        QEventLoop loop;
+        QObject::connect(&document, &EPubDocument::loadCompleted, &loop, &QEventLoop::quit);
+        loop.exec();
+    }
+    bookStatistics->loadMs = timer.restart();
+
+    // Same as what the widget shows
+    QAbstractTextDocumentLayout::PaintContext paintContext;
+    paintContext.palette = QGuiApplication::palette();
+    for (int group = 0; group < 3; ++group) {
+        paintContext.palette.setColor(QPalette::ColorGroup(group), QPalette::WindowText, Qt::black);
+        paintContext.palette.setColor(QPalette::ColorGroup(group), QPalette::Light, Qt::black);
+        paintContext.palette.setColor(QPalette::ColorGroup(group), QPalette::Text, Qt::black);
+        paintContext.palette.setColor(QPalette::ColorGroup(group), QPalette::Base, Qt::black);
+
+        paintContext.palette.setColor(QPalette::ColorGroup(group), QPalette::Window, Qt::white);
+        paintContext.palette.setColor(QPalette::ColorGroup(group), QPalette::Button, Qt::white);
+    }
+
+    bool success = true;
+    const int pageCount = qMin(m_pageCount, document.pageCount());
+    for (int i=0; i<pageCount; i++) {
+        QImage image(m_pageSize, QImage::Format_ARGB32_Premultiplied);
+        image.fill(Qt::white);
+
+        paintContext.clip = QRectF(QPointF(0, i * m_pageSize.height()), m_pageSize);
+
+        QPainter painter(&image);
+        painter.translate(0, -paintContext.clip.top());
+        painter.setClipRect(paintContext.clip);
+        document.documentLayout()->draw(&painter, paintContext);
+        painter.end();
+
+        if (!savePage(image, outputDir, i)) {
+            success = false;
+            break;
+        }
+        bookStatistics->pages++;
+    }
+    bookStatistics->renderMs = timer.elapsed();
+
+    return success && pageCount > 0;
+}
+
+bool PreviewRenderer::renderFixedLayout(const QSharedPointer<EPubSession> &session, const QDir &outputDir, Statistics *bookStatistics)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    FixedLayoutEngine engine(nullptr);
+    engine.setPageSize(m_pageSize);
+    if (!engine.openDocument(session)) {
+        return false;
+    }
+    bookStatistics->loadMs = timer.restart();
+
+    bool success = true;
+    const int pageCount = qMin(m_pageCount, engine.pageCount());
+    for (int i=0; i<pageCount; i++) {
+        // The pages are decoded in the background
+        QImage page = engine.page(i);
+        while (page.isNull() && engine.isPagePending(i)) {
+            QEventLoop loop;
+            QObject::connect(&engine, &FixedLayoutEngine::pageReady, &loop, [&](int index) {
+                if (index == i) {
+                    loop.quit();
+                }
+            });
+            loop.exec();
+            page = engine.page(i);
+        }
+        if (page.isNull()) {
+            success = false;
+            break;
+        }
+
+        QImage image(m_pageSize, QImage::Format_ARGB32_Premultiplied);
+        image.fill(Qt::white);
+
+        QRect pageRect(QPoint(0, 0), page.size() / page.devicePixelRatio());
+        pageRect.moveCenter(image.rect().center());
+
+        QPainter painter(&image);
+        painter.drawImage(pageRect, page);
+        painter.end();
+
+        if (!savePage(image, outputDir, i)) {
+            success = false;
+            break;
+        }
+        bookStatistics->pages++;
+    }
+    bookStatistics->renderMs = timer.elapsed();
+
+    return success && pageCount > 0;
+}
+
+bool PreviewRenderer::savePage(const QImage &image, const QDir &outputDir, int index)
+{
+    const QString outputPath = outputDir.filePath(QString("page-%1.png").arg(index + 1, 4, 10, QLatin1Char('0')));
+    if (!image.save(outputPath)) {
+        qWarning() << "Failed to write" << outputPath;
+        return false;
+    }
+    return true;
+}
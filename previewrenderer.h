@@ -0,0 +1,43 @@
+#ifndef PREVIEWRENDERER_H
+#define PREVIEWRENDERER_H
+
+#include <QSharedPointer>
+#include <QSize>
+#include <QString>
+
+class EPubSession;
+class QDir;
+class QImage;
+
+// Writes the first pages of books as PNG images, without a display. Only
+// as much of a book as is needed for those pages is laid out, and images
+// are decoded right away instead of in the background.
+class PreviewRenderer
+{
+public:
+    struct Statistics {
+        int books = 0;
+        int failedBooks = 0;
+        int pages = 0;
+        qint64 loadMs = 0;
+        qint64 renderMs = 0;
+    };
+
+    PreviewRenderer(const QString &outputFolder, const QSize &pageSize, int pageCount);
+
+    bool renderFile(const QString &path);
+
+    const Statistics &statistics() const { return m_statistics; }
+
+private:
+    bool renderReflowable(const QSharedPointer<EPubSession> &session, const QDir &outputDir, Statistics *bookStatistics);
+    bool renderFixedLayout(const QSharedPointer<EPubSession> &session, const QDir &outputDir, Statistics *bookStatistics);
+    bool savePage(const QImage &image, const QDir &outputDir, int index);
+
+    QString m_outputFolder;
+    QSize m_pageSize;
+    int m_pageCount;
+    Statistics m_statistics;
+};
+
+#endif // PREVIEWRENDERER_H
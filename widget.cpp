@@ -1,19 +1,28 @@
 #include "widget.h"
 
 #include "epubdocument.h"
+#include "epubsession.h"
+#include "fixedlayoutengine.h"
 
 #include <QFileDialog>
 #include <QSettings>
 #include <QDebug>
 #include <QPainter>
 #include <QKeyEvent>
+#include <QMouseEvent>
+#include <QDesktopServices>
+#include <QTextBlock>
+#include <QTextLayout>
 #include <QAbstractTextDocumentLayout>
 #include <QApplication>
 
 Widget::Widget(QWidget *parent)
     : QDialog(parent),
       m_document(new EPubDocument(this)),
-      m_currentChapter(0)
+      m_fixedLayout(nullptr),
+      m_currentPage(0),
+      m_currentChapter(0),
+      m_yOffset(0)
 {
     setWindowFlags(Qt::Dialog);
     resize(600, 800);
@@ -22,6 +31,11 @@ Widget::Widget(QWidget *parent)
     connect(m_document, &EPubDocument::loadCompleted, this, [&]() {
         update();
     });
+
+    // E. g. images decoded in the background
+    connect(m_document->documentLayout(), &QAbstractTextDocumentLayout::update, this, [&](const QRectF &rect) {
+        update(rect.translated(0, -m_yOffset).toAlignedRect());
+    });
 }
 
 Widget::~Widget()
@@ -52,14 +66,46 @@ bool Widget::loadFile(const QString &path)
         return false;
     }
 
+    // Comics and such are shown as page images instead
+    QSharedPointer<EPubSession> session = EPubSession::open(path);
+    if (session && FixedLayoutEngine::isFixedLayout(session->container())) {
+        if (!m_fixedLayout) {
+            m_fixedLayout = new FixedLayoutEngine(this);
+            connect(m_fixedLayout, &FixedLayoutEngine::pageReady, this, [&](int index) {
+                if (index == m_currentPage) {
+                    update();
+                }
+            });
+        }
+        m_fixedLayout->setPageSize(size());
+        m_currentPage = 0;
+        const bool success = m_fixedLayout->openDocument(session);
+        update();
+        return success;
+    }
+
+    delete m_fixedLayout;
+    m_fixedLayout = nullptr;
+
     m_document->setPageSize(size());
-    m_document->openDocument(path);
+    m_document->openDocument(session);
 
     return true;
 }
 
+void Widget::showPage(int index)
+{
+    m_currentPage = qBound(0, index, m_fixedLayout->pageCount() - 1);
+    update();
+}
+
 void Widget::scroll(int amount)
 {
+    if (m_fixedLayout) {
+        showPage(m_currentPage + (amount > 0 ? 1 : -1));
+        return;
+    }
+
     int offset = m_yOffset + amount;
     offset = qMin(int(m_document->size().height() - m_document->pageSize().height()), offset);
     m_yOffset = qMax(0, offset);
@@ -68,6 +114,11 @@ void Widget::scroll(int amount)
 
 void Widget::scrollPage(int amount)
 {
+    if (m_fixedLayout) {
+        showPage(m_currentPage + amount);
+        return;
+    }
+
     int currentPage = m_yOffset / m_document->pageSize().height();
     currentPage += amount;
     int offset = currentPage * m_document->pageSize().height();
@@ -76,10 +127,68 @@ void Widget::scrollPage(int amount)
     update();
 }
 
+void Widget::scrollTo(int position)
+{
+    const QTextBlock block = m_document->findBlock(position);
+    if (!block.isValid()) {
+        return;
+    }
+
+    // Footnotes and such are often in the middle of a block
+    int offset = m_document->documentLayout()->blockBoundingRect(block).top();
+    const QTextLine line = block.layout()->lineForTextPosition(position - block.position());
+    if (line.isValid()) {
+        offset += line.y();
+    }
+    offset = qMin(int(m_document->size().height() - m_document->pageSize().height()), offset);
+    m_yOffset = qMax(0, offset);
+    update();
+}
+
+void Widget::followLink(const QString &href)
+{
+    const QUrl url(href);
+    if (!url.scheme().isEmpty()) {
+        // Books aren't trusted, so they don't get to open local files or run things
+        const QString scheme = url.scheme().toLower();
+        if (scheme == "http" || scheme == "https" || scheme == "mailto") {
+            QDesktopServices::openUrl(url);
+        } else {
+            qWarning() << "Not opening link with unsupported scheme" << href;
+        }
+        return;
+    }
+
+    const int position = m_document->anchorPosition(href);
+    if (position == -1) {
+        qWarning() << "Unable to follow link to" << href;
+        return;
+    }
+
+    scrollTo(position);
+}
+
 void Widget::paintEvent(QPaintEvent*)
 {
     QPainter painter(this);
     painter.fillRect(rect(), Qt::white);
+
+    if (m_fixedLayout) {
+        const QImage page = m_fixedLayout->page(m_currentPage);
+        if (page.isNull() && m_fixedLayout->isPageFailed(m_currentPage)) {
+            painter.drawText(rect(), Qt::AlignCenter, "Unable to show this page");
+            return;
+        }
+        if (page.isNull()) {
+            painter.drawText(rect(), Qt::AlignCenter, "Loading...");
+            return;
+        }
+        QRect pageRect(QPoint(0, 0), page.size() / page.devicePixelRatio());
+        pageRect.moveCenter(rect().center());
+        painter.drawImage(pageRect, page);
+        return;
+    }
+
     if (!m_document->loaded()) {
         painter.drawText(rect(), Qt::AlignCenter, "Loading...");
         return;
@@ -116,6 +225,8 @@ void Widget::keyPressEvent(QKeyEvent *event)
         scrollPage(-1);
     } else if (event->key() == Qt::Key_PageDown) {
         scrollPage(1);
+    } else if (event->key() == Qt::Key_End && m_fixedLayout) {
+        showPage(m_fixedLayout->pageCount() - 1);
     } else if (event->key() == Qt::Key_End) {
         m_yOffset = m_document->size().height() - m_document->pageSize().height();
         update();
@@ -124,8 +235,24 @@ void Widget::keyPressEvent(QKeyEvent *event)
     }
 }
 
+void Widget::mouseReleaseEvent(QMouseEvent *event)
+{
+    if (event->button() != Qt::LeftButton || m_fixedLayout || !m_document->loaded()) {
+        return;
+    }
+
+    const QString href = m_document->documentLayout()->anchorAt(event->pos() + QPoint(0, m_yOffset));
+    if (!href.isEmpty()) {
+        followLink(href);
+    }
+}
+
 void Widget::resizeEvent(QResizeEvent *)
 {
+    if (m_fixedLayout) {
+        m_fixedLayout->setPageSize(size());
+    }
+
     m_document->clearCache();
     m_document->setPageSize(size());
     update();
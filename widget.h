@@ -5,6 +5,7 @@
 
 class EPubDocument;
 class EPubContainer;
+class FixedLayoutEngine;
 
 class Widget : public QDialog
 {
@@ -16,6 +17,9 @@ public:
 
     void scroll(int amount);
     void scrollPage(int amount);
+    void scrollTo(int position);
+    void followLink(const QString &href);
+    void showPage(int index);
     bool loadFile(const QString &path);
     bool loadFile();
 
@@ -23,10 +27,13 @@ protected:
     void paintEvent(QPaintEvent *event) override;
     void keyPressEvent(QKeyEvent *event) override;
     void resizeEvent(QResizeEvent *event) override;
+    void mouseReleaseEvent(QMouseEvent *event) override;
 
 private:
     QImage m_cover;
     EPubDocument *m_document;
+    FixedLayoutEngine *m_fixedLayout; // only for pre-paginated books
+    int m_currentPage;
     int m_currentChapter;
     int m_yOffset;
 };